@@ -3,21 +3,59 @@
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <initializer_list>
 #include <iostream>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <sstream>
 #include <string>
-#include <time.h>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
-std::ofstream nullStream;
-std::ostream& output = nullStream;     // Easily switch off output
-//std::ostream & output = std::cout;   // Or use this one to enable output
-
-#define DebugOut(x)
-//#define DebugOut(x) x
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Tracing, for following what the simulation does without slowing it down. BLACKJACKSIM_TRACE_LEVEL
+// picks what's traced when it's compiled: 0, the default, compiles every Trace away. 1 traces each
+// round's deal, shoe reloads, dealer hands, hand outcomes and the results recorded into the table,
+// and 2 also every action played.
+#ifndef BLACKJACKSIM_TRACE_LEVEL
+#define BLACKJACKSIM_TRACE_LEVEL 0
+#endif
+
+constexpr int c_traceLevel = BLACKJACKSIM_TRACE_LEVEL;
+constexpr int c_traceRounds = 1;
+constexpr int c_traceActions = 2;
+
+#if BLACKJACKSIM_TRACE_LEVEL > 0
+#define Trace(level, x) do { if constexpr ((level) <= c_traceLevel) { x; } } while (false)
+#else
+#define Trace(level, x)
+#endif
 
 enum class CardFace
 {
@@ -44,10 +82,41 @@ enum class CardSuit
 	Diamonds,
 };
 
+enum class Action
+{
+	Stand,
+	Hit,
+	DoubleDown,
+	Split
+};
+
+const char* GetActionString(Action action)
+{
+	switch (action)
+	{
+		case Action::Stand:
+			return "Stand";
+		case Action::Hit:
+			return "Hit";
+		case Action::DoubleDown:
+			return "Double Down";
+		case Action::Split:
+			return "Split";
+		default:
+			return "ERROR";
+	}
+}
+
+constexpr uint8_t ActionBit(Action action)
+{
+	return static_cast<uint8_t>(1 << static_cast<int>(action));
+}
+
 
 class Card
 {
 public:
+	Card() = default;
 	Card(int cardValue);
 
 	CardFace Face() const;
@@ -57,11 +126,11 @@ public:
 	std::string ToString() const;
 
 private:
-	int m_rawValue;
+	uint8_t m_rawValue;
 };
 
 Card::Card(int cardValue)
-	: m_rawValue(cardValue)
+	: m_rawValue(static_cast<uint8_t>(cardValue))
 {
 	
 }
@@ -89,8 +158,8 @@ int Card::Value() const
 
 std::string Card::ToString() const
 {
-	constexpr char* g_szSuitNames[4] = { "S", "H", "C", "D" };
-	constexpr char* g_szFaceNames[13] = { "A", "2", "3", "4", "5", "6", "7", "8", "9", "10", "J", "Q", "K" };
+	constexpr const char* g_szSuitNames[4] = { "S", "H", "C", "D" };
+	constexpr const char* g_szFaceNames[13] = { "A", "2", "3", "4", "5", "6", "7", "8", "9", "10", "J", "Q", "K" };
 
 	std::string strFaceName = g_szFaceNames[static_cast<size_t>(Face())];
 	std::string strSuitName = g_szSuitNames[static_cast<size_t>(Suit())];
@@ -98,6 +167,102 @@ std::string Card::ToString() const
 	return strFaceName + strSuitName;
 }
 
+// Cards in trace records are faces, 0 for an ace up to 12 for a king, with 0xFF for no card
+enum class TraceEvent : uint8_t
+{
+	Reload,     // value: the cards dealt from the shoe before it was reloaded
+	Deal,       // args: the player's two cards, the upcard, the hole card, the count bucket, the seat
+	Action,     // args: the action, the card it dealt, the hand's value after it
+	Dealer,     // args: the hole card, the upcard, the dealer's final value, its card count
+	Outcome,    // args: a TraceOutcome, the player's value, the dealer's value. value: the result per unit bet
+	Result,     // args: the dealer hand index, the player hand index, the action, the count bucket. value: the result recorded
+};
+
+enum class TraceOutcome : uint8_t
+{
+	Busted,
+	BlackjackPush,
+	DealerBlackjack,
+	Blackjack,
+	Won,
+	Pushed,
+	Lost,
+};
+
+struct TraceRecord
+{
+	uint32_t round;         // Counted per thread from 1, at each round's first deal
+	TraceEvent event;
+	uint8_t args[7];
+	float value;
+};
+
+static_assert(sizeof(TraceRecord) == 16, "TraceRecord is a file format");
+
+// One thread's trace. Once it's full, each record overwrites the oldest, so it keeps the latest
+// c_records of them. Writing one is a few stores, with nothing formatted until it's decoded.
+class TraceRing
+{
+public:
+	static constexpr size_t c_records = size_t(1) << 20;
+
+	TraceRing() : m_records(c_records) { }
+
+	void StartRound() { m_round++; }
+	void Write(TraceEvent event, std::initializer_list<int> args, float value = 0.0f);
+
+	// The record count, then the records oldest first
+	void Save(std::ostream& out) const;
+
+private:
+	std::vector<TraceRecord> m_records;
+	uint64_t m_written = 0;
+	uint32_t m_round = 0;
+};
+
+void TraceRing::Write(TraceEvent event, std::initializer_list<int> args, float value)
+{
+	assert(args.size() <= std::size(TraceRecord().args));
+
+	TraceRecord& record = m_records[m_written++ & (c_records - 1)];
+	record = { m_round, event, {}, value };
+
+	const size_t argCount = std::min(args.size(), std::size(record.args));
+	for (size_t a = 0; a < argCount; a++)
+		record.args[a] = static_cast<uint8_t>(args.begin()[a]);
+}
+
+void TraceRing::Save(std::ostream& out) const
+{
+	const uint64_t count = std::min<uint64_t>(m_written, c_records);
+	const size_t oldest = m_written > c_records ? m_written & (c_records - 1) : 0;
+
+	out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+	out.write(reinterpret_cast<const char*>(m_records.data() + oldest), (count - (m_written > c_records ? oldest : 0)) * sizeof(TraceRecord));
+	if (m_written > c_records)
+		out.write(reinterpret_cast<const char*>(m_records.data()), oldest * sizeof(TraceRecord));
+}
+
+// Every thread's trace, in the order they first traced. They're owned here so they outlive their
+// threads, and can be written out once the run is over.
+std::mutex g_traceMutex;
+std::vector<std::unique_ptr<TraceRing>> g_traceRings;
+
+TraceRing& ThisThreadTrace()
+{
+	thread_local TraceRing* ring = [] {
+		std::lock_guard<std::mutex> lock(g_traceMutex);
+		g_traceRings.push_back(std::make_unique<TraceRing>());
+		return g_traceRings.back().get();
+	}();
+	return *ring;
+}
+
+int TraceCard(Card card)
+{
+	return static_cast<int>(card.Face());
+}
+
 class Player
 {
 public:
@@ -121,67 +286,366 @@ protected:
 };
 
 
+// xoshiro256** (Blackman & Vigna), seeded through splitmix64. It's a good deal faster than
+// std::default_random_engine, and unlike the standard distributions everything built on it here
+// is fully specified, so a seed deals the same cards with every compiler. Jump() advances 2^128
+// steps, which splits off streams that will never overlap.
+class RandomEngine
+{
+public:
+	using result_type = uint64_t;
+
+	explicit RandomEngine(uint64_t seed);
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return UINT64_MAX; }
+
+	result_type operator()();
+	uint32_t NextBelow(uint32_t bound);
+	double NextDouble() { return ((*this)() >> 11) * 0x1.0p-53; }   // Uniform in [0, 1)
+	void Jump();
+
+private:
+	static uint64_t RotateLeft(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+
+	std::array<uint64_t, 4> m_state;
+};
+
+RandomEngine::RandomEngine(uint64_t seed)
+{
+	for (auto& word : m_state)
+	{
+		uint64_t z = (seed += 0x9e3779b97f4a7c15);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		word = z ^ (z >> 31);
+	}
+}
+
+RandomEngine::result_type RandomEngine::operator()()
+{
+	const uint64_t result = RotateLeft(m_state[1] * 5, 7) * 9;
+	const uint64_t t = m_state[1] << 17;
+
+	m_state[2] ^= m_state[0];
+	m_state[3] ^= m_state[1];
+	m_state[1] ^= m_state[2];
+	m_state[0] ^= m_state[3];
+	m_state[2] ^= t;
+	m_state[3] = RotateLeft(m_state[3], 45);
+
+	return result;
+}
+
+// Uniform in [0, bound), using Lemire's multiply-and-reject method to avoid a division
+uint32_t RandomEngine::NextBelow(uint32_t bound)
+{
+	uint64_t product = ((*this)() >> 32) * bound;
+	uint32_t low = static_cast<uint32_t>(product);
+
+	if (low < bound)
+	{
+		const uint32_t threshold = (0u - bound) % bound;
+		while (low < threshold)
+		{
+			product = ((*this)() >> 32) * bound;
+			low = static_cast<uint32_t>(product);
+		}
+	}
+
+	return static_cast<uint32_t>(product >> 32);
+}
+
+void RandomEngine::Jump()
+{
+	constexpr uint64_t c_jump[] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+
+	std::array<uint64_t, 4> jumped = {};
+	for (uint64_t jumpWord : c_jump)
+	{
+		for (int bit = 0; bit < 64; bit++)
+		{
+			if (jumpWord & (uint64_t(1) << bit))
+			{
+				for (int i = 0; i < 4; i++)
+					jumped[i] ^= m_state[i];
+			}
+			(*this)();
+		}
+	}
+
+	m_state = jumped;
+}
+
+
+// Number of cards of each rank, where a rank is a card's face with the ten valued faces lumped
+// together: 0 is an ace, 1 - 8 are two through nine, 9 is any ten. As every rank below ten is a
+// single face, a rank doubles as the CardFace of a representative card.
+constexpr int c_rankCount = 10;
+using RankCounts = std::array<uint16_t, c_rankCount>;
+
+int GetRank(Card card)
+{
+	return std::min(static_cast<int>(card.Face()), c_rankCount - 1);
+}
+
+// A set of card faces, one bit per CardFace
+using FaceMask = uint16_t;
+
+constexpr FaceMask FaceBit(int face)
+{
+	return static_cast<FaceMask>(1 << face);
+}
+
+FaceMask GetRankFaces(int rank)
+{
+	// Tens, jacks, queens and kings share the last rank
+	return rank == c_rankCount - 1 ? static_cast<FaceMask>(0x1E00) : FaceBit(rank);
+}
+
+// Checkpoints are raw bytes: everything in them is trivially copyable, so loading one is a
+// straight read into place with nothing to parse.
+template <typename T>
+void WriteRaw(std::ostream& out, const T& value)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Only plain data can be written raw");
+	out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool ReadRaw(std::istream& in, T& value)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Only plain data can be read raw");
+	return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+// A file of pre-shuffled shoes, mapped into memory so a shoe is dealt straight from the page cache
+// rather than shuffled. The file is a CorpusHeader followed by each shoe's cards, one byte per
+// card holding its raw value. Runs dealing from the same corpus see exactly the same cards, so
+// two builds or two strategies can be compared on them.
+struct CorpusHeader
+{
+	char magic[8];
+	uint32_t version;
+	int32_t decks;
+	uint64_t shoeCount;
+	uint64_t seed;          // The seed the shoes were shuffled with
+};
+
+constexpr char c_corpusMagic[8] = "BJSCRPS";
+constexpr uint32_t c_corpusVersion = 1;
+
+class ShoeCorpus
+{
+public:
+	ShoeCorpus() = default;
+	~ShoeCorpus() { Close(); }
+
+	ShoeCorpus(const ShoeCorpus&) = delete;
+	ShoeCorpus& operator=(const ShoeCorpus&) = delete;
+
+	// Returns false if the file can't be mapped or isn't a corpus from this build
+	bool Open(const std::string& path);
+
+	int Decks() const { return m_header.decks; }
+	uint64_t ShoeCount() const { return m_header.shoeCount; }
+	uint64_t Seed() const { return m_header.seed; }
+	const uint8_t* Shoe(uint64_t index) const { return m_cards + index * 52 * m_header.decks; }
+
+private:
+	void Close();
+
+	CorpusHeader m_header = {};
+	const uint8_t* m_cards = nullptr;
+	const void* m_view = nullptr;
+	size_t m_size = 0;
+};
+
+bool ShoeCorpus::Open(const std::string& path)
+{
+	Close();
+
+#ifdef _WIN32
+	const HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	const HANDLE mapping = GetFileSizeEx(file, &size) ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+	CloseHandle(file);
+	if (mapping == nullptr)
+		return false;
+
+	// The view keeps the mapping alive on its own
+	m_view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (m_view == nullptr)
+		return false;
+	m_size = static_cast<size_t>(size.QuadPart);
+#else
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0)
+	{
+		close(file);
+		return false;
+	}
+
+	// The mapping outlives the descriptor
+	void* view = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, file, 0);
+	close(file);
+	if (view == MAP_FAILED)
+		return false;
+	m_view = view;
+	m_size = static_cast<size_t>(status.st_size);
+#endif
+
+	if (m_size < sizeof(CorpusHeader))
+		return Close(), false;
+
+	memcpy(&m_header, m_view, sizeof(m_header));
+	const bool isValid = memcmp(m_header.magic, c_corpusMagic, sizeof(m_header.magic)) == 0 && m_header.version == c_corpusVersion
+		&& m_header.decks >= 1 && m_header.shoeCount > 0 && m_size == sizeof(CorpusHeader) + m_header.shoeCount * 52 * m_header.decks;
+	if (!isValid)
+		return Close(), false;
+
+	m_cards = static_cast<const uint8_t*>(m_view) + sizeof(CorpusHeader);
+	return true;
+}
+
+void ShoeCorpus::Close()
+{
+	if (m_view != nullptr)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(m_view);
+#else
+		munmap(const_cast<void*>(m_view), m_size);
+#endif
+	}
+
+	m_header = {};
+	m_cards = nullptr;
+	m_view = nullptr;
+	m_size = 0;
+}
+
+// Which of a corpus's shoes a DeckShoe deals, in turn: nextShoe, then every stride shoes after it,
+// wrapping around at the end of the corpus. Workers and batch lanes take interleaved streams, so
+// no two deal the same shoe until the corpus wraps.
+struct CorpusStream
+{
+	const ShoeCorpus* corpus = nullptr;     // Shuffle instead when there isn't one
+	uint64_t nextShoe = 0;
+	uint64_t stride = 1;
+};
+
 class DeckShoe
 {
 public:
-	DeckShoe(int deckCount);
+	DeckShoe(int deckCount, const RandomEngine& randomEngine, const CorpusStream& corpus = {});
 
 	size_t Size() const { return m_cards.size(); }
-	Card GetCard(size_t offset) const { return m_cards[offset]; }
+	Card GetCard(size_t offset) const { assert(offset < m_cards.size()); return m_cards[offset]; }
+	RankCounts RemainingRanks(size_t offset) const;
 
 	void Reload();
+	void UseCorpus(const CorpusStream& corpus);
+	void WriteCards(std::ostream& out) const;
+	size_t PickMatching(size_t offset, FaceMask faces);
+	void SwapCards(size_t first, size_t second);
+	void UndoSwaps();
+
+	void Save(std::ostream& out) const;
+	bool Load(std::istream& in);
 
 private:
-	void Clear();
 	void LoadDecks();
 	void Shuffle();
+	void LoadCorpusShoe();
+	void CountRemainingRanks();
+
+	struct Swap
+	{
+		size_t first;
+		size_t second;
+		int firstRank;      // Of the card that was at first before the swap
+		int secondRank;
+	};
 
-	std::default_random_engine m_randomEngine;
 	std::vector<Card> m_cards;
+	std::vector<RankCounts> m_remainingRanks;   // Ranks still in the shoe at each offset, before any swaps
+	std::array<Swap, 4> m_swaps = {};           // Swaps since the last UndoSwaps, in order
+	int m_swapCount = 0;
 	int m_decks;
+	RandomEngine m_randomEngine;
+	CorpusStream m_corpus;
 };
 
 class DeckShoeView
 {
 public:
 	DeckShoeView(const DeckShoe& deckShoe)
-		: m_shoe(deckShoe)
+		: m_shoe(&deckShoe)
 	{ }
 
 	Card DealCard();
 	int Offset() const { return m_cardOffset; }
 	void SetOffset(int offset) { m_cardOffset = offset; }
 
+	RankCounts RemainingRanks() const { return m_shoe->RemainingRanks(m_cardOffset); }
+	bool IsInfinite() const { return false; }
+
 protected:
 	int m_cardOffset = 0;
-	const DeckShoe& m_shoe;
+	const DeckShoe* m_shoe;
 };
 
+// Cards kept back past the reload point for each seat's hand and the dealer's. It's a heuristic
+// margin rather than a bound: a round full of small cards and splits could deal more, but a hand
+// taking ten cards is rare enough that no run has been seen to.
+constexpr int c_handReserveCards = 10;
+
+// Where a shoe of this many cards reloads. Shoes only reload between rounds, so however deep the
+// penetration it stops short of the end by a single seat's margin. --seats checks the penetration
+// leaves enough for every seat.
+int ReloadOffset(double penetration, int shoeSize)
+{
+	return std::min(static_cast<int>(penetration * shoeSize), shoeSize - 2 * c_handReserveCards);
+}
+
 class MasterDeckShoeView : public DeckShoeView
 {
 public:
-	MasterDeckShoeView(DeckShoe& deckShoe)
+	MasterDeckShoeView(DeckShoe& deckShoe, double penetration)
 		: DeckShoeView(deckShoe)
 		, m_masterShoe(deckShoe)
+		, m_reloadOffset(ReloadOffset(penetration, static_cast<int>(deckShoe.Size())))
 	{ }
 
 	void ReloadIfNecessary();
 
 private:
 	DeckShoe& m_masterShoe;
+	int m_reloadOffset;     // Reshuffle once this much of the shoe has been dealt
 };
 
 void DeckShoe::Reload()
 {
-	Clear();
-	LoadDecks();
-	Shuffle();
+	// The shoe always holds the same cards, so there's no need to rebuild it before shuffling
+	assert(m_swapCount == 0);
+	if (m_corpus.corpus != nullptr)
+		LoadCorpusShoe();
+	else
+		Shuffle();
 }
 
 void MasterDeckShoeView::ReloadIfNecessary()
 {
-	double c_penetration = 0.7;
-	if (m_cardOffset > (c_penetration * m_masterShoe.Size()))
+	if (m_cardOffset > m_reloadOffset)
 	{
 		m_masterShoe.Reload();
 		m_cardOffset = 0;
@@ -190,21 +654,17 @@ void MasterDeckShoeView::ReloadIfNecessary()
 
 Card DeckShoeView::DealCard()
 {
-	return m_shoe.GetCard(m_cardOffset++);
+	return m_shoe->GetCard(m_cardOffset++);
 }
 
 
-DeckShoe::DeckShoe(int deckCount)
+DeckShoe::DeckShoe(int deckCount, const RandomEngine& randomEngine, const CorpusStream& corpus)
 	: m_decks(deckCount)
-	, m_randomEngine(std::random_device{}())
+	, m_randomEngine(randomEngine)
+	, m_corpus(corpus)
 {
 	LoadDecks();
-	Shuffle();
-}
-
-void DeckShoe::Clear()
-{
-	m_cards.clear();
+	Reload();
 }
 
 void DeckShoe::LoadDecks()
@@ -221,748 +681,5442 @@ void DeckShoe::LoadDecks()
 
 void DeckShoe::Shuffle()
 {
-	std::shuffle(begin(m_cards), end(m_cards), m_randomEngine);
+	// Fisher-Yates, spelled out because std::shuffle's results differ between standard libraries
+	for (size_t i = m_cards.size() - 1; i > 0; i--)
+	{
+		const size_t j = m_randomEngine.NextBelow(static_cast<uint32_t>(i + 1));
+		std::swap(m_cards[i], m_cards[j]);
+	}
+
+	CountRemainingRanks();
 }
 
-class Hand
+// Replaces the current shoe with the stream's first, and deals the rest of the stream from then on
+void DeckShoe::UseCorpus(const CorpusStream& corpus)
 {
-public:
-	void AddCard(Card card);
-
-	int          Value() const;
-	bool         IsBusted() const { return Value() > 21; }
-	bool         IsSoft() const;
-	bool         IsBlackjack() const;
-	Card         GetCard(int i) const { return m_cards[i]; }
-	bool         IsFromSplit() const { return m_isFromSplit; }
-	void         SetIsFromSplit() { m_isFromSplit = true; }
-
-	std::string  ToString() const;
-
-protected:
-	bool     m_isFromSplit = false;
+	m_corpus = corpus;
+	Reload();
+}
 
-	std::pair<int, bool> ComputeValue() const;  // sum, isSoft
+// The corpus must hold shoes of this many decks
+void DeckShoe::LoadCorpusShoe()
+{
+	static_assert(sizeof(Card) == 1, "Corpus shoes are copied straight into the cards");
+	assert(m_corpus.corpus->Decks() == m_decks);
 
-	std::vector<Card> m_cards;
-};
+	const uint64_t shoe = m_corpus.nextShoe % m_corpus.corpus->ShoeCount();
+	memcpy(m_cards.data(), m_corpus.corpus->Shoe(shoe), m_cards.size());
+	m_corpus.nextShoe = (shoe + m_corpus.stride) % m_corpus.corpus->ShoeCount();
 
+	CountRemainingRanks();
+}
 
-void Hand::AddCard(Card card)
+void DeckShoe::CountRemainingRanks()
 {
-	m_cards.emplace_back(card);
+	// Every count is updated, rather than indexing the one that changes, so the counts can stay
+	// in registers. Incrementing one in memory and copying them all out straight after stalls on
+	// every card.
+	RankCounts remainingRanks = {};
+	m_remainingRanks.resize(m_cards.size() + 1);
+	m_remainingRanks.back() = remainingRanks;
+	for (size_t i = m_cards.size(); i > 0; i--)
+	{
+		const int cardRank = GetRank(m_cards[i - 1]);
+		for (int rank = 0; rank < c_rankCount; rank++)
+			remainingRanks[rank] += rank == cardRank;
+		m_remainingRanks[i - 1] = remainingRanks;
+	}
 }
 
-std::pair<int, bool> Hand::ComputeValue() const  // <sum, isSoft
+RankCounts DeckShoe::RemainingRanks(size_t offset) const
 {
-	int sum = 0;
-	int aceCount = 0;
-
-	for (const auto & card : m_cards)
+	RankCounts remainingRanks = m_remainingRanks[offset];
+	for (int i = 0; i < m_swapCount; i++)
 	{
-		sum += card.Value();
-		if (card.Face() == CardFace::Ace)
-			aceCount++;
+		const Swap& swap = m_swaps[i];
+		if (swap.first < offset && offset <= swap.second)
+		{
+			remainingRanks[swap.firstRank]++;
+			remainingRanks[swap.secondRank]--;
+		}
 	}
+	return remainingRanks;
+}
+
+// Picks one of the cards from offset on with one of the faces, uniformly, and returns its position.
+// Returns Size() if there aren't any.
+size_t DeckShoe::PickMatching(size_t offset, FaceMask faces)
+{
+	auto isMatch = [&](size_t i) { return (faces & FaceBit(static_cast<int>(m_cards[i].Face()))) != 0; };
 
-	// Adjust aces so they don't 'bust' us
-	while (aceCount > 0 && sum > 21)
+	// A random position that matches is a random match. That usually takes about a dozen tries, so
+	// the cards are only counted out when the faces are scarce.
+	const uint32_t remaining = static_cast<uint32_t>(m_cards.size() - offset);
+	for (int attempt = 0; attempt < 64 && remaining > 0; attempt++)
 	{
-		aceCount--;
-		sum -= 10;
+		const size_t i = offset + m_randomEngine.NextBelow(remaining);
+		if (isMatch(i))
+			return i;
 	}
 
-	return std::make_pair(sum, aceCount > 0);
-}
+	uint32_t matching = 0;
+	for (size_t i = offset; i < m_cards.size(); i++)
+		matching += isMatch(i);
 
-int Hand::Value() const
-{
-	return ComputeValue().first;
-}
+	if (matching == 0)
+		return m_cards.size();
 
-bool Hand::IsSoft() const
-{
-	return ComputeValue().second;
+	uint32_t pick = m_randomEngine.NextBelow(matching);
+	size_t i = offset;
+	for (;; i++)
+	{
+		if (isMatch(i) && pick-- == 0)
+			break;
+	}
+	return i;
 }
 
-bool Hand::IsBlackjack() const
+// Swaps are only meant to last a round, so rather than fixing up the remaining ranks at every
+// offset in between, RemainingRanks corrects for them until they're undone
+void DeckShoe::SwapCards(size_t first, size_t second)
 {
-	return m_cards.size() == 2 && Value() == 21;
+	assert(first <= second && m_swapCount < static_cast<int>(m_swaps.size()));
+	m_swaps[m_swapCount++] = { first, second, GetRank(m_cards[first]), GetRank(m_cards[second]) };
+	std::swap(m_cards[first], m_cards[second]);
 }
 
-
-std::string Hand::ToString() const
+void DeckShoe::UndoSwaps()
 {
-	std::ostringstream oss;
-
-	bool isFirstCard = true;
-
-	for (const auto & card : m_cards)
+	while (m_swapCount > 0)
 	{
-		if (!isFirstCard)
-			oss << ", ";
-		isFirstCard = false;
-
-		oss << card.ToString();
+		const Swap& swap = m_swaps[--m_swapCount];
+		std::swap(m_cards[swap.first], m_cards[swap.second]);
 	}
-
-	return oss.str();
 }
 
-class DealerHand : public Hand
+void DeckShoe::WriteCards(std::ostream& out) const
 {
-public:
-	DealerHand()
-		: m_isFirstCardHidden(true)
-	{ }
-
-	int Showing() const;
-	std::string ToString() const;
-
-	void FlipHiddenCard() { m_isFirstCardHidden = false; }
-
-protected:
-	bool m_isFirstCardHidden;
-};
+	out.write(reinterpret_cast<const char*>(m_cards.data()), m_cards.size() * sizeof(Card));
+}
 
-int DealerHand::Showing() const
+void DeckShoe::Save(std::ostream& out) const
 {
-	return m_cards[1].Value();
+	assert(m_swapCount == 0);
+	WriteRaw(out, m_randomEngine);
+	WriteRaw(out, m_corpus.nextShoe);
+	WriteCards(out);
 }
 
-std::string DealerHand::ToString() const
+// The shoe must already hold the same number of decks as the one that was saved, and deal from
+// the same corpus if it did
+bool DeckShoe::Load(std::istream& in)
 {
-	if (m_isFirstCardHidden)
-		return m_cards[1].ToString();
-	else
-		return __super::ToString();
+	if (!ReadRaw(in, m_randomEngine) || !ReadRaw(in, m_corpus.nextShoe)
+		|| !in.read(reinterpret_cast<char*>(m_cards.data()), m_cards.size() * sizeof(Card)))
+		return false;
+
+	CountRemainingRanks();
+	return true;
 }
 
-class PlayerSubHand : public Hand
+// The shoes the simulation can deal from. Each one deals through DealCard, hands out a View that
+// branches can deal from without disturbing it, and can be advanced to a view afterwards.
+
+// Owns a shuffled DeckShoe and the master view dealing from it, so it can be held by value
+class ShuffledShoe
 {
 public:
-	PlayerSubHand(Player& player)
-		: m_player(player)
-		, m_bet(1.0)
-	{ }
+	using View = DeckShoeView;
 
-	Player& Owner() { return m_player; }
+	ShuffledShoe(int deckCount, double penetration, const RandomEngine& randomEngine)
+		: m_shoeCards(deckCount, randomEngine)
+		, m_shoe(m_shoeCards, penetration)
+	{ }
 
-	bool CanHit() const;
-	bool CanSplit() const;
-	bool CanDoubleDown() const { return m_cards.size() == 2; }
-	double Bet() const { return m_bet; }
-	const std::string PlayerName() const { return m_player.Name(); }
+	ShuffledShoe(const ShuffledShoe&) = delete;
+	ShuffledShoe& operator=(const ShuffledShoe&) = delete;
 
-	void DoubleDown(Card card);
-	PlayerSubHand Split(DeckShoeView & shoe);
-	void PayoutHand(double result);
+	Card DealCard() { return m_shoe.DealCard(); }
+	Card DealMatching(FaceMask faces);
+	void ReloadIfNecessary() { m_shoe.ReloadIfNecessary(); }
 
-private:
-	Player&  m_player;
-	double   m_bet;
-};
+	// Only before anything has been dealt
+	void UseCorpus(const CorpusStream& corpus) { m_shoeCards.UseCorpus(corpus); }
 
-class PlayerHand
-{
-public:
-	PlayerHand(Player & player)
-		: m_player(player)
-		, m_subHands{{player}}
+	// Starts over from a freshly shuffled shoe
+	void Reshuffle()
 	{
+		m_shoeCards.Reload();
+		m_shoe.SetOffset(0);
 	}
 
-	Player& Owner() { return m_player; }
-	std::string PlayerName() const { return m_player.Name(); }
-
-	std::list<PlayerSubHand>& SubHands() { return m_subHands; }
-	PlayerSubHand& PrimaryHand() { return m_subHands.front(); }
+	// Swaps the matched cards back once their round is done. The shoe then goes on as though the
+	// round had been dealt naturally, rather than running short of whatever the matches took.
+	void RestoreMatched() { m_shoeCards.UndoSwaps(); }
 
-	bool CanHit() const;
+	View CurrentView() const { return m_shoe; }
+	void AdvanceTo(const View& view) { m_shoe.SetOffset(view.Offset()); }
 
-	void AddCard(Card card);
-	void Split(PlayerSubHand& subHand, DeckShoeView& shoe);
+	void Save(std::ostream& out) const;
+	bool Load(std::istream& in);
 
 private:
-	Player&  m_player;
-	std::list<PlayerSubHand> m_subHands;
+	DeckShoe m_shoeCards;
+	MasterDeckShoeView m_shoe;
 };
 
-void PlayerHand::AddCard(Card card)
+// Deals a card with one of the faces, by swapping a random one of them to the front of the shoe.
+// Taking the first one instead would tell the cards before it apart from the rest. The cards left
+// are still in random order either way. If none of the faces are left, deals whatever's next.
+Card ShuffledShoe::DealMatching(FaceMask faces)
 {
-	m_subHands.front().AddCard(card);
-}
+	const size_t offset = m_shoe.Offset();
+	const size_t position = m_shoeCards.PickMatching(offset, faces);
+	if (position < m_shoeCards.Size() && position != offset)
+		m_shoeCards.SwapCards(offset, position);
 
-bool PlayerHand::CanHit() const
-{
-	for (const auto& subHand : m_subHands)
-	{
-		if (subHand.CanHit())
-			return true;
-	}
-	return false;
+	return m_shoe.DealCard();
 }
 
-void PlayerHand::Split(PlayerSubHand& subHand, DeckShoeView& shoe)
+void ShuffledShoe::Save(std::ostream& out) const
 {
-	PlayerSubHand newHand = subHand.Split(shoe);
-	m_subHands.push_back(std::move(newHand));
+	m_shoeCards.Save(out);
+	WriteRaw(out, m_shoe.Offset());
 }
 
-bool PlayerSubHand::CanSplit() const
+bool ShuffledShoe::Load(std::istream& in)
 {
-	return m_cards.size() == 2 && m_cards[0].Face() == m_cards[1].Face();
+	int offset;
+	if (!m_shoeCards.Load(in) || !ReadRaw(in, offset))
+		return false;
+
+	m_shoe.SetOffset(offset);
+	return true;
+}
+
+// Suits never matter to play, so rather than shuffling every card this only tracks how many of
+// each face are left and draws in proportion to them. The whole shoe is a few dozen bytes,
+// so a copy of it is its own view. The infinite variant never depletes, dealing every face
+// with a fixed 1/13 chance.
+class CompositionShoe
+{
+public:
+	using View = CompositionShoe;
+
+	CompositionShoe(int deckCount, double penetration, const RandomEngine& randomEngine, bool isInfinite = false);
+
+	Card DealCard();
+	Card DealMatching(FaceMask faces);
+	void RestoreMatched();
+	int Offset() const { return m_cardOffset; }
+	void ReloadIfNecessary();
+
+	RankCounts RemainingRanks() const;
+	bool IsInfinite() const { return m_isInfinite; }
+
+	const View& CurrentView() const { return *this; }
+	void AdvanceTo(const View& view) { *this = view; }
+
+	void Save(std::ostream& out) const { WriteRaw(out, *this); }
+	bool Load(std::istream& in) { return ReadRaw(in, *this); }
+
+private:
+	void Reload();
+
+	std::array<uint16_t, 13> m_faceCounts;
+	int m_cardsPerFace;
+	int m_reloadOffset;     // Reload once this many cards have been dealt
+	int m_cardsRemaining;
+	int m_cardOffset = 0;
+	bool m_isInfinite;
+	RandomEngine m_randomEngine;
+
+	// Faces DealMatching drew since the last RestoreMatched
+	std::array<int8_t, 4> m_matchedFaces = {};
+	int m_matchedFaceCount = 0;
+};
+
+class InfiniteShoe : public CompositionShoe
+{
+public:
+	InfiniteShoe(int deckCount, double penetration, const RandomEngine& randomEngine)
+		: CompositionShoe(deckCount, penetration, randomEngine, true)
+	{ }
+};
+
+CompositionShoe::CompositionShoe(int deckCount, double penetration, const RandomEngine& randomEngine, bool isInfinite)
+	: m_cardsPerFace(4 * deckCount)
+	, m_reloadOffset(ReloadOffset(penetration, 13 * m_cardsPerFace))
+	, m_isInfinite(isInfinite)
+	, m_randomEngine(randomEngine)
+{
+	Reload();
+}
+
+void CompositionShoe::Reload()
+{
+	m_faceCounts.fill(static_cast<uint16_t>(m_cardsPerFace));
+	m_cardsRemaining = 13 * m_cardsPerFace;
+	m_cardOffset = 0;
+}
+
+void CompositionShoe::ReloadIfNecessary()
+{
+	if (!m_isInfinite && m_cardOffset > m_reloadOffset)
+		Reload();
+}
+
+RankCounts CompositionShoe::RemainingRanks() const
+{
+	// An infinite shoe always looks like a fresh one
+	RankCounts ranks = {};
+	for (int face = 0; face < 13; face++)
+		ranks[GetRank(Card(face))] += m_isInfinite ? m_cardsPerFace : m_faceCounts[face];
+	return ranks;
+}
+
+Card CompositionShoe::DealCard()
+{
+	m_cardOffset++;
+
+	if (m_isInfinite)
+		return Card(static_cast<int>(m_randomEngine.NextBelow(13)));
+
+	assert(m_cardsRemaining > 0);
+	uint32_t pick = m_randomEngine.NextBelow(static_cast<uint32_t>(m_cardsRemaining));
+
+	int face = 0;
+	while (pick >= m_faceCounts[face])
+	{
+		pick -= m_faceCounts[face];
+		face++;
+	}
+
+	m_faceCounts[face]--;
+	m_cardsRemaining--;
+	return Card(face);
+}
+
+// Draws one of the faces, in proportion to how many of each are left. If none are left, draws
+// from the whole shoe.
+Card CompositionShoe::DealMatching(FaceMask faces)
+{
+	uint32_t matching = 0;
+	for (int face = 0; face < 13; face++)
+	{
+		if (faces & FaceBit(face))
+			matching += m_isInfinite ? 1 : m_faceCounts[face];
+	}
+
+	if (matching == 0)
+		return DealCard();
+
+	m_cardOffset++;
+	uint32_t pick = m_randomEngine.NextBelow(matching);
+
+	int face = 0;
+	for (;; face++)
+	{
+		if ((faces & FaceBit(face)) == 0)
+			continue;
+
+		const uint32_t count = m_isInfinite ? 1 : m_faceCounts[face];
+		if (pick < count)
+			break;
+		pick -= count;
+	}
+
+	if (!m_isInfinite)
+	{
+		assert(m_matchedFaceCount < static_cast<int>(m_matchedFaces.size()));
+		m_matchedFaces[m_matchedFaceCount++] = static_cast<int8_t>(face);
+		m_faceCounts[face]--;
+		m_cardsRemaining--;
+	}
+	return Card(face);
+}
+
+// Puts the matched faces back once their round is done and draws as many at random instead,
+// so the shoe doesn't run short of whatever the matches took
+void CompositionShoe::RestoreMatched()
+{
+	for (int i = 0; i < m_matchedFaceCount; i++)
+	{
+		m_faceCounts[m_matchedFaces[i]]++;
+		m_cardsRemaining++;
+	}
+
+	for (; m_matchedFaceCount > 0; m_matchedFaceCount--)
+	{
+		uint32_t pick = m_randomEngine.NextBelow(static_cast<uint32_t>(m_cardsRemaining));
+		int face = 0;
+		while (pick >= m_faceCounts[face])
+		{
+			pick -= m_faceCounts[face];
+			face++;
+		}
+
+		m_faceCounts[face]--;
+		m_cardsRemaining--;
+	}
+}
+
+// A hand's cards boil down to a small integer state holding everything the rules care about: the
+// total, whether an ace is in play, how many cards there are (0, 1, 2 or more), whether it's a
+// pair (and of what), and whether it came from a split. All the states reachable through play are
+// numbered up front, along with each state's successor for every card face, so adding a card and
+// asking about the hand are both single table lookups.
+using HandState = uint16_t;
+
+struct HandStateInfo
+{
+	uint8_t  value = 0;
+	bool     isSoft = false;
+	bool     isBlackjack = false;
+	bool     isFromSplit = false;
+	bool     dealerMustHit[2] = {};    // Indexed by whether the dealer hits soft 17
+	uint8_t  actionMasks[4] = {};      // ActionBit of every action allowed, see RuleSet::c_actionMaskIndex
+	int8_t   playerHandIndex = -1;     // See MapPlayerHandToActionIndex, -1 if the hand can't act
+};
+
+class HandStateTable
+{
+public:
+	HandStateTable();
+
+	static constexpr HandState c_emptyHand = 0;
+
+	HandState Next(HandState state, CardFace face) const { return m_transitions[state][static_cast<int>(face)]; }
+	HandState SplitHand(CardFace face) const { return m_splitHands[static_cast<int>(face)]; }
+	const HandStateInfo& Info(HandState state) const { return m_info[state]; }
+	size_t StateCount() const { return m_info.size(); }
+
+private:
+	struct Key
+	{
+		int  hardSum;      // Aces counted as 1
+		bool hasAce;
+		int  cardCount;    // Saturates at 3
+		int  firstFace;    // -1 once it no longer matters
+		bool isPair;
+		bool isFromSplit;
+	};
+
+	static Key Canonicalize(Key key);
+	static int Pack(const Key& key);
+	static HandStateInfo Describe(const Key& key);
+
+	HandState AddState(const Key& key);
+
+	std::vector<std::array<HandState, 13>> m_transitions;
+	std::vector<HandStateInfo> m_info;
+	std::vector<Key> m_keys;
+	std::vector<int> m_stateByPackedKey;
+	std::array<HandState, 13> m_splitHands;
+};
+
+HandStateTable::HandStateTable()
+	: m_stateByPackedKey(1 << 14, -1)
+{
+	AddState(Key{ 0, false, 0, -1, false, false });
+	for (int face = 0; face < 13; face++)
+		m_splitHands[face] = AddState(Key{ Card(face).Value() == 11 ? 1 : Card(face).Value(), face == 0, 1, face, false, true });
+
+	// New states are appended as they're discovered, so this visits every reachable state
+	for (size_t state = 0; state < m_keys.size(); state++)
+	{
+		for (int face = 0; face < 13; face++)
+		{
+			const Key key = m_keys[state];
+			const int cardValue = Card(face).Value();
+
+			Key next = key;
+			if (Describe(key).value <= 21)
+			{
+				next.hardSum += (cardValue == 11) ? 1 : cardValue;
+				next.hasAce = key.hasAce || cardValue == 11;
+				next.cardCount = std::min(key.cardCount + 1, 3);
+				next.isPair = key.cardCount == 1 && key.firstFace == face;
+				if (key.cardCount == 0)
+					next.firstFace = face;
+			}
+			// else busted hands never draw again, they just stay put
+
+			m_transitions[state][face] = AddState(next);
+		}
+	}
+
+	m_keys.clear();
+	m_stateByPackedKey.clear();
+}
+
+HandStateTable::Key HandStateTable::Canonicalize(Key key)
+{
+	// The first card only matters while it can still form a pair, for naming the pair, and for
+	// the split aces rule. Forgetting it otherwise keeps the state count down.
+	const bool firstFaceMatters = key.cardCount == 1 || key.isPair || (key.isFromSplit && key.firstFace == 0);
+	if (!firstFaceMatters)
+		key.firstFace = -1;
+	return key;
+}
+
+int HandStateTable::Pack(const Key& key)
+{
+	assert(key.hardSum < 32);
+	return key.hardSum
+		| (key.hasAce << 5)
+		| (key.cardCount << 6)
+		| ((key.firstFace + 1) << 8)
+		| (key.isPair << 12)
+		| (key.isFromSplit << 13);
+}
+
+HandStateInfo HandStateTable::Describe(const Key& key)
+{
+	HandStateInfo info;
+
+	// At most one ace can count as 11 without busting the hand
+	info.isSoft = key.hasAce && key.hardSum + 10 <= 21;
+	const int value = info.isSoft ? key.hardSum + 10 : key.hardSum;
+
+	info.value = static_cast<uint8_t>(value);
+	info.isBlackjack = key.cardCount == 2 && value == 21;
+	info.isFromSplit = key.isFromSplit;
+	info.dealerMustHit[false] = value < 17;
+	info.dealerMustHit[true] = value < 17 || (value == 17 && info.isSoft);
+
+	// Every rule that limits the player's actions gets its answer worked out here, so a RuleSet
+	// picks its mask with a constant index rather than checking the rules during play
+	for (int maskIndex = 0; maskIndex < 4; maskIndex++)
+	{
+		const bool doubleAfterSplit = (maskIndex & 1) != 0;
+		const bool hitSplitAces = (maskIndex & 2) != 0;
+
+		// Unless they can be hit, split aces get one card each and that's it
+		const bool isSplitAces = key.isFromSplit && key.firstFace == 0;
+		const bool isFinished = value >= 21 || (isSplitAces && !hitSplitAces);
+
+		uint8_t actionMask = ActionBit(Action::Stand);
+		if (!isFinished)
+			actionMask |= ActionBit(Action::Hit);
+		if (!isFinished && key.cardCount == 2 && (doubleAfterSplit || !key.isFromSplit))
+			actionMask |= ActionBit(Action::DoubleDown);
+		if (key.isPair)
+			actionMask |= ActionBit(Action::Split);
+
+		info.actionMasks[maskIndex] = actionMask;
+	}
+
+	// 0: 8 or less
+	// 1 - 12: 9 through 20
+	// 13 - 20: Soft 13 through 20
+	// 21 - 30: Double A through 10
+	if (value >= 21)
+		info.playerHandIndex = -1;
+	else if (key.isPair && key.firstFace == 0)
+		info.playerHandIndex = 21;
+	else if (key.isPair)
+		info.playerHandIndex = static_cast<int8_t>(20 + Card(key.firstFace).Value());
+	else if (info.isSoft && value >= 13)
+		info.playerHandIndex = static_cast<int8_t>(value);
+	else if (value <= 8)
+		info.playerHandIndex = 0; //compress uninteresting values
+	else
+		info.playerHandIndex = static_cast<int8_t>(value - 8);
+
+	return info;
+}
+
+HandState HandStateTable::AddState(const Key& key)
+{
+	const Key canonicalKey = Canonicalize(key);
+	const int packedKey = Pack(canonicalKey);
+
+	if (m_stateByPackedKey[packedKey] >= 0)
+		return static_cast<HandState>(m_stateByPackedKey[packedKey]);
+
+	const HandState state = static_cast<HandState>(m_info.size());
+	m_stateByPackedKey[packedKey] = state;
+	m_keys.push_back(canonicalKey);
+	m_info.push_back(Describe(canonicalKey));
+	m_transitions.emplace_back();
+	return state;
+}
+
+const HandStateTable g_handStates;
+
+// The rules of the table that come up during play. The simulation is templated on a RuleSet, so
+// every rule is a constant: the rules that limit hands pick a precomputed answer out of the
+// hand's state with a constant index, and the payout folds into the arithmetic.
+template <bool THitSoft17, bool TDoubleAfterSplit, bool THitSplitAces, int TBlackjackPayoutNumerator, int TBlackjackPayoutDenominator>
+struct RuleSet
+{
+	static constexpr bool c_hitSoft17 = THitSoft17;
+	static constexpr bool c_doubleAfterSplit = TDoubleAfterSplit;
+	static constexpr bool c_hitSplitAces = THitSplitAces;
+	static constexpr int c_blackjackPayoutNumerator = TBlackjackPayoutNumerator;
+	static constexpr int c_blackjackPayoutDenominator = TBlackjackPayoutDenominator;
+	static constexpr double c_blackjackPayout = double(TBlackjackPayoutNumerator) / TBlackjackPayoutDenominator;
+
+	// Which of HandStateInfo::actionMasks applies under these rules
+	static constexpr int c_actionMaskIndex = (TDoubleAfterSplit ? 1 : 0) | (THitSplitAces ? 2 : 0);
+
+	static bool DealerMustHit(const HandStateInfo& info) { return info.dealerMustHit[c_hitSoft17]; }
+	static uint8_t ActionMask(const HandStateInfo& info) { return info.actionMasks[c_actionMaskIndex]; }
+};
+
+// Dealer hits soft 17, double after split, split aces get one card, blackjack pays 3:2
+using DefaultRuleSet = RuleSet<true, true, false, 3, 2>;
+
+
+// Hands stop drawing once they reach 21, and every card adds at least 1, so no hand can get past 21 cards
+constexpr int c_maxHandCards = 21;
+
+class Hand
+{
+public:
+	void AddCard(Card card);
+
+	HandState    State() const { return m_state; }
+	const HandStateInfo& Info() const { return g_handStates.Info(m_state); }
+
+	int          Value() const { return Info().value; }
+	bool         IsBusted() const { return Info().value > 21; }
+	bool         IsSoft() const { return Info().isSoft; }
+	bool         IsBlackjack() const { return Info().isBlackjack; }
+	int          CardCount() const { return m_cardCount; }
+	Card         GetCard(int i) const { return m_cards[i]; }
+	bool         IsFromSplit() const { return Info().isFromSplit; }
+
+	std::string  ToString() const;
+
+protected:
+	void ResetToSplitCard(Card card);
+
+	std::array<Card, c_maxHandCards> m_cards;
+	int          m_cardCount = 0;
+	HandState    m_state = HandStateTable::c_emptyHand;
+};
+
+
+void Hand::AddCard(Card card)
+{
+	assert(m_cardCount < c_maxHandCards);
+	m_cards[m_cardCount++] = card;
+	m_state = g_handStates.Next(m_state, card.Face());
+}
+
+void Hand::ResetToSplitCard(Card card)
+{
+	m_cards[0] = card;
+	m_cardCount = 1;
+	m_state = g_handStates.SplitHand(card.Face());
+}
+
+
+std::string Hand::ToString() const
+{
+	std::ostringstream oss;
+
+	for (int i = 0; i < m_cardCount; i++)
+	{
+		if (i != 0)
+			oss << ", ";
+
+		oss << m_cards[i].ToString();
+	}
+
+	return oss.str();
+}
+
+class DealerHand : public Hand
+{
+public:
+	DealerHand()
+		: m_isFirstCardHidden(true)
+	{ }
+
+	int Showing() const;
+	std::string ToString() const;
+
+	void FlipHiddenCard() { m_isFirstCardHidden = false; }
+
+protected:
+	bool m_isFirstCardHidden;
+};
+
+int DealerHand::Showing() const
+{
+	return m_cards[1].Value();
+}
+
+std::string DealerHand::ToString() const
+{
+	if (m_isFirstCardHidden)
+		return m_cards[1].ToString();
+	else
+		return Hand::ToString();
+}
+
+class PlayerSubHand : public Hand
+{
+public:
+	PlayerSubHand() = default;
+	PlayerSubHand(Player& player)
+		: m_player(&player)
+	{ }
+
+	Player& Owner() { return *m_player; }
+
+	template <typename TRules>
+	bool CanDoAction(Action action) const { return (TRules::ActionMask(Info()) & ActionBit(action)) != 0; }
+
+	double Bet() const { return m_bet; }
+	const std::string PlayerName() const { return m_player->Name(); }
+
+	void DoubleDown(Card card);
+	template <typename TShoeView>
+	PlayerSubHand Split(TShoeView & shoe);
+	void PayoutHand(double result);
+
+private:
+	Player*  m_player = nullptr;
+	double   m_bet = 1.0;
+};
+
+// Room to split every card of one face in a six deck shoe. Splitting is refused beyond that, or
+// beyond the table's limit if it's lower.
+constexpr int c_maxSubHands = 24;
+
+// Sub hands are stored inline so a PlayerHand never allocates, and copying one only copies the
+// sub hands in use. That makes a copy a cheap checkpoint to roll a round back to.
+class PlayerHand
+{
+public:
+	PlayerHand(Player & player, int maxSubHands = c_maxSubHands)
+		: m_player(&player)
+		, m_subHandCount(1)
+		, m_maxSubHands(std::min(maxSubHands, c_maxSubHands))
+	{
+		m_subHands[0] = PlayerSubHand(player);
+	}
+
+	PlayerHand(const PlayerHand& other) { *this = other; }
+	PlayerHand& operator=(const PlayerHand& other);
+
+	Player& Owner() { return *m_player; }
+	std::string PlayerName() const { return m_player->Name(); }
+
+	int SubHandCount() const { return m_subHandCount; }
+	PlayerSubHand& SubHand(int i) { return m_subHands[i]; }
+	const PlayerSubHand& SubHand(int i) const { return m_subHands[i]; }
+	PlayerSubHand& PrimaryHand() { return m_subHands[0]; }
+
+	template <typename TRules>
+	bool CanHit() const;
+	template <typename TRules>
+	uint8_t ActionMask(const PlayerSubHand& subHand) const;
+
+	void AddCard(Card card);
+	template <typename TShoeView>
+	void Split(PlayerSubHand& subHand, TShoeView& shoe);
+
+private:
+	Player*  m_player;
+	int      m_subHandCount;
+	int      m_maxSubHands;
+	std::array<PlayerSubHand, c_maxSubHands> m_subHands;
+};
+
+PlayerHand& PlayerHand::operator=(const PlayerHand& other)
+{
+	m_player = other.m_player;
+	m_subHandCount = other.m_subHandCount;
+	m_maxSubHands = other.m_maxSubHands;
+	std::copy_n(other.m_subHands.begin(), other.m_subHandCount, m_subHands.begin());
+	return *this;
+}
+
+void PlayerHand::AddCard(Card card)
+{
+	m_subHands[0].AddCard(card);
+}
+
+template <typename TRules>
+bool PlayerHand::CanHit() const
+{
+	for (int i = 0; i < m_subHandCount; i++)
+	{
+		if (m_subHands[i].CanDoAction<TRules>(Action::Hit))
+			return true;
+	}
+	return false;
+}
+
+template <typename TRules>
+uint8_t PlayerHand::ActionMask(const PlayerSubHand& subHand) const
+{
+	uint8_t actionMask = TRules::ActionMask(subHand.Info());
+	if (m_subHandCount == m_maxSubHands)
+		actionMask &= ~ActionBit(Action::Split);
+	return actionMask;
+}
+
+template <typename TShoeView>
+void PlayerHand::Split(PlayerSubHand& subHand, TShoeView& shoe)
+{
+	assert(m_subHandCount < m_maxSubHands);
+	m_subHands[m_subHandCount++] = subHand.Split(shoe);
+}
+
+void PlayerSubHand::DoubleDown(Card card)
+{
+	assert(m_cardCount == 2);
+	m_bet *= 2;
+	AddCard(card);
+}
+
+template <typename TShoeView>
+PlayerSubHand PlayerSubHand::Split(TShoeView & shoe)
+{
+	PlayerSubHand newHand(Owner());
+
+	// Whether a hand is a pair doesn't depend on the rules, so any of its masks will do
+	assert(Info().actionMasks[0] & ActionBit(Action::Split));
+
+	newHand.ResetToSplitCard(m_cards[1]);
+	ResetToSplitCard(m_cards[0]);
+
+	newHand.AddCard(shoe.DealCard());
+	AddCard(shoe.DealCard());
+
+	return newHand;
+}
+
+void PlayerSubHand::PayoutHand(double result)
+{
+	m_player->AdjustMoney(m_bet * result);
+}
+
+enum class BlackjackPayout
+{
+	ThreeToTwo,
+	SixToFive,
+};
+
+// A table's rules as chosen at runtime. DispatchRuleSet turns the ones that come up during play
+// into a RuleSet once, up front. The rest are only looked at when a shoe is built or reloaded,
+// a round starts or a hand splits, so they stay runtime values.
+struct TableRules
+{
+	int decks = 6;
+	double penetration = 0.7;       // Fraction of the shoe dealt before it's reshuffled
+	int maxHands = c_maxSubHands;   // Hands a player can split up to
+	int seats = 1;                  // Players at the table, every one playing the same strategy
+	bool hitSoft17 = true;
+	bool doubleAfterSplit = true;
+	bool hitSplitAces = false;
+	BlackjackPayout blackjackPayout = BlackjackPayout::ThreeToTwo;
+
+	bool operator==(const TableRules& other) const;
+};
+
+bool TableRules::operator==(const TableRules& other) const
+{
+	return decks == other.decks
+		&& penetration == other.penetration
+		&& maxHands == other.maxHands
+		&& seats == other.seats
+		&& hitSoft17 == other.hitSoft17
+		&& doubleAfterSplit == other.doubleAfterSplit
+		&& hitSplitAces == other.hitSplitAces
+		&& blackjackPayout == other.blackjackPayout;
+}
+
+// Calls func with a default constructed RuleSet matching the rules. Each rule picked here
+// instantiates everything func uses once per choice, so only the rules the inner loop checks
+// belong here.
+template <bool... TRules, typename TFunc>
+auto DispatchRuleSet(const TableRules& rules, TFunc&& func)
+{
+	constexpr size_t c_chosen = sizeof...(TRules);
+
+	if constexpr (c_chosen == 0)
+		return rules.hitSoft17 ? DispatchRuleSet<TRules..., true>(rules, func) : DispatchRuleSet<TRules..., false>(rules, func);
+	else if constexpr (c_chosen == 1)
+		return rules.doubleAfterSplit ? DispatchRuleSet<TRules..., true>(rules, func) : DispatchRuleSet<TRules..., false>(rules, func);
+	else if constexpr (c_chosen == 2)
+		return rules.hitSplitAces ? DispatchRuleSet<TRules..., true>(rules, func) : DispatchRuleSet<TRules..., false>(rules, func);
+	else if (rules.blackjackPayout == BlackjackPayout::SixToFive)
+		return func(RuleSet<TRules..., 6, 5>());
+	else
+		return func(RuleSet<TRules..., 3, 2>());
+}
+
+
+template <typename TRules>
+double GetHandOutcome(const PlayerSubHand & playerHand, const Hand & dealerHand)
+{
+	auto outcome = [&]([[maybe_unused]] TraceOutcome traceOutcome, double result) {
+		Trace(c_traceRounds, ThisThreadTrace().Write(TraceEvent::Outcome, { static_cast<int>(traceOutcome), playerHand.Value(), dealerHand.Value() }, static_cast<float>(result)));
+		return result;
+	};
+
+	if (playerHand.IsBusted())
+		return outcome(TraceOutcome::Busted, -1);
+	else if (playerHand.IsBlackjack() && dealerHand.IsBlackjack())
+		return outcome(TraceOutcome::BlackjackPush, 0);
+	else if (dealerHand.IsBlackjack())
+		return outcome(TraceOutcome::DealerBlackjack, -1);
+	else if (playerHand.IsBlackjack())
+		return outcome(TraceOutcome::Blackjack, TRules::c_blackjackPayout);
+	else if (dealerHand.IsBusted() || playerHand.Value() > dealerHand.Value())
+		return outcome(TraceOutcome::Won, 1.0);
+	else if (playerHand.Value() == dealerHand.Value())
+		return outcome(TraceOutcome::Pushed, 0.0);
+	else
+		return outcome(TraceOutcome::Lost, -1.0);
+}
+
+// Starts a new round in the trace at the first seat's deal
+void TraceDeal(const PlayerSubHand& hand, const DealerHand& dealerHand, int countBucket, int seat)
+{
+	TraceRing& trace = ThisThreadTrace();
+	if (seat == 0)
+		trace.StartRound();
+
+	trace.Write(TraceEvent::Deal, { TraceCard(hand.GetCard(0)), TraceCard(hand.GetCard(1)), TraceCard(dealerHand.GetCard(1)), TraceCard(dealerHand.GetCard(0)), countBucket, seat });
+}
+
+constexpr int c_maxPlayerHandIndex = 31;
+constexpr int c_maxDealerHandIndex = 10;
+
+int MapPlayerHandToActionIndex(const PlayerSubHand & hand)
+{
+	// See HandStateTable::Describe for the layout
+	const int playerHandIndex = hand.Info().playerHandIndex;
+	assert(playerHandIndex >= 0);
+	return playerHandIndex;
+}
+
+// DealerHand actions:
+//  2-10 = 0-8
+//  A = 9
+int MapDealerHandToActionIndex(int dealerCardValue)
+{
+	if (dealerCardValue == 1)
+		return 9;
+	else
+		return dealerCardValue - 2;
+}
+
+std::string GetNextAction(DealerHand & dealer, PlayerHand & player)
+{
+	return "s";
+}
+
+template <typename TRules>
+bool RunOneRoundInteractively(MasterDeckShoeView & shoe, std::vector<Player> & players)
+{
+	DealerHand dealerHand;
+	std::list<PlayerSubHand> playerHands;
+
+	shoe.ReloadIfNecessary();
+
+	for (auto & player : players)
+	{
+		playerHands.emplace_back(player);
+	}
+
+	for (auto & hand : playerHands)
+	{
+		hand.AddCard(shoe.DealCard());
+	}
+	dealerHand.AddCard(shoe.DealCard());
+
+	for (auto & hand : playerHands)
+	{
+		hand.AddCard(shoe.DealCard());
+	}
+	dealerHand.AddCard(shoe.DealCard());
+
+	//output << "*******************************************" << std::endl;
+	for (auto & hand : playerHands)
+	{
+		std::cout << "Dealer showing: " << dealerHand.ToString() << " (" << dealerHand.Showing() << ")" << std::endl;
+		std::cout << hand.PlayerName() <<  "'s hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl;
+
+		while (hand.CanDoAction<TRules>(Action::Hit) && !dealerHand.IsBlackjack())
+		{
+			std::cout << "Action ((h)it, (s)tand, s(p)lit, (d)ouble down)? ";
+			std::string userAction;
+			std::cin >> userAction;
+
+			Action action;
+			if (userAction == "h") action = Action::Hit;
+			else if (userAction == "s") action = Action::Stand;
+			else if (userAction == "p") action = Action::Split;
+			else if (userAction == "d") action = Action::DoubleDown;
+			else continue;
+
+			if ((action == Action::DoubleDown && !hand.CanDoAction<TRules>(Action::DoubleDown)) || (action == Action::Split && !hand.CanDoAction<TRules>(Action::Split)))
+			{
+				std::cout << "Can't " << GetActionString(action) << " right now\n";
+			}
+
+			if (action == Action::Hit)
+			{
+				std::cout << "Hitting\n";
+				hand.AddCard(shoe.DealCard());
+				std::cout << hand.PlayerName() <<  "'s hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl;
+			}
+			else if (action == Action::Stand)
+			{
+				std::cout << "Standing\n";
+				break;
+			}
+			else if (action == Action::Split && hand.CanDoAction<TRules>(Action::Split))
+			{
+				// TODO
+				playerHands.emplace_back(hand.Split(shoe));
+				std::cout << hand.PlayerName() <<  "'s hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl;
+			}
+			else if (action == Action::Split)
+			{
+				std::cout << "Hand not split-able" << std::endl;
+			}
+			else if (action == Action::DoubleDown)
+			{
+				const Card card = shoe.DealCard();
+				hand.DoubleDown(card);
+				std::cout << hand.PlayerName() <<  "'s hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl;
+				break;
+			}
+		}
+	}
+
+	// TODO: check for all players busted
+	dealerHand.FlipHiddenCard();
+
+	std::cout << "Dealer: " << dealerHand.ToString() << " (" << dealerHand.Value() << ")" << std::endl;
+
+	while (TRules::DealerMustHit(dealerHand.Info()))
+	{
+		auto card = shoe.DealCard();
+		dealerHand.AddCard(card);
+	}
+
+	for (auto & player : players)
+	{
+		player.SignalNewHand();
+	}
+
+	for (auto & hand : playerHands)
+	{
+		std::cout << std::endl;
+		std::cout << hand.PlayerName() <<  "'s final hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl;
+		const double outcome = GetHandOutcome<TRules>(hand, dealerHand);
+
+		hand.PayoutHand(outcome);
+		std::cout << "Payout: " << hand.Bet() * outcome << " (" << hand.Owner().Money() << ")\n\n";
+	}
+
+	return true;
+}
+
+void PlayInteractively()
+{
+	const TableRules rules;
+	DeckShoe shoeCards(rules.decks, RandomEngine(std::random_device{}()));
+	MasterDeckShoeView shoe(shoeCards, rules.penetration);
+	Player dealer(std::string("Dealer"), 0);
+
+	std::vector<Player> players;
+
+	double bestExpectedValue = -100;
+
+	players.emplace_back("Player 1", 0.0);
+	//players.emplace_back("Player 2", 500.0);
+
+
+	bool fRunMore = true;
+
+	//while (fRunMore)
+	for (;;)
+	{
+		players[0].ClearStats();
+
+		fRunMore = RunOneRoundInteractively<DefaultRuleSet>(shoe, players);
+	}
+}
+
+template <typename TRules>
+bool CanDoAction(const PlayerHand& playerHand, const PlayerSubHand& hand, Action action)
+{
+	return (playerHand.ActionMask<TRules>(hand) & ActionBit(action)) != 0;
+}
+
+template <typename TShoeView>
+void DoAction(PlayerHand& playerHand, PlayerSubHand& subHand, Action action, TShoeView& shoe)
+{
+	switch (action)
+	{
+		case Action::Hit:
+		{
+			const Card card = shoe.DealCard();
+			subHand.AddCard(card);
+
+			Trace(c_traceActions, ThisThreadTrace().Write(TraceEvent::Action, { static_cast<int>(action), TraceCard(card), subHand.Value() }));
+			break;
+		}
+		case Action::Stand:
+			Trace(c_traceActions, ThisThreadTrace().Write(TraceEvent::Action, { static_cast<int>(action), 0xFF, subHand.Value() }));
+			break;
+		case Action::DoubleDown:
+		{
+			const Card card = shoe.DealCard();
+			subHand.DoubleDown(card);
+			Trace(c_traceActions, ThisThreadTrace().Write(TraceEvent::Action, { static_cast<int>(action), TraceCard(card), subHand.Value() }));
+			break;
+		}
+		case Action::Split:
+			playerHand.Split(subHand, shoe);
+			Trace(c_traceActions, ThisThreadTrace().Write(TraceEvent::Action, { static_cast<int>(action), TraceCard(subHand.GetCard(1)), subHand.Value() }));
+			break;
+		default:
+			throw std::runtime_error("Unexpected action");
+	}
+}
+
+// Keeps the sum of squares rather than a running mean and M2 (Welford), as plain sums merge
+// across shards by addition. Results are small bounded payouts, so the variance computed from
+// them doesn't suffer the cancellation that usually argues for Welford.
+struct ResultData
+{
+	double result = 0.0;        // Sum of the results
+	double sumOfSquares = 0.0;
+	int64_t count = 0;          // 64 bits, as merged shards can hold more results than any one run
+
+	double Mean() const { return result / count; }
+	double Variance() const;
+	double StandardError() const { return std::sqrt(Variance() / count); }
+};
+
+// Sample variance
+double ResultData::Variance() const
+{
+	if (count < 2)
+		return 0.0;
+
+	const double mean = Mean();
+	return std::max(0.0, (sumOfSquares - count * mean * mean) / (count - 1));
+}
+
+class ResultsCell
+{
+public:
+	const ResultData& GetResultData(Action action) const;
+	void AddResult(Action action, double result);
+	void Merge(const ResultsCell& other);
+private:
+	ResultData m_actionResults[4];
+};
+
+const ResultData& ResultsCell::GetResultData(Action action) const
+{
+	return m_actionResults[static_cast<int>(action)];
+}
+
+void ResultsCell::AddResult(Action action, double result)
+{
+	m_actionResults[static_cast<int>(action)].count++;
+	m_actionResults[static_cast<int>(action)].result += result;
+	m_actionResults[static_cast<int>(action)].sumOfSquares += result * result;
+}
+
+void ResultsCell::Merge(const ResultsCell& other)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		m_actionResults[i].count += other.m_actionResults[i].count;
+		m_actionResults[i].result += other.m_actionResults[i].result;
+		m_actionResults[i].sumOfSquares += other.m_actionResults[i].sumOfSquares;
+	}
+}
+
+// Hi-Lo true counts from -6 to +6 get a count bucket each, with counts beyond that clamped to the ends
+constexpr int c_maxTrueCount = 6;
+constexpr int c_trueCountBuckets = 2 * c_maxTrueCount + 1;
+
+// The Hi-Lo running count of the cards dealt so far per deck left in the shoe, rounded down.
+// Hi-Lo's tags add up to zero over a full shoe, so the count of the cards dealt is just the
+// count of the cards left, negated.
+int GetTrueCountBucket(const RankCounts& remainingRanks)
+{
+	int runningCount = 0;
+	int cardsRemaining = 0;
+	for (int rank = 0; rank < c_rankCount; rank++)
+	{
+		// Twos through sixes count +1 when dealt, tens and aces -1
+		if (rank >= 1 && rank <= 5)
+			runningCount -= remainingRanks[rank];
+		else if (rank == 0 || rank == c_rankCount - 1)
+			runningCount += remainingRanks[rank];
+
+		cardsRemaining += remainingRanks[rank];
+	}
+
+	const int trueCount = cardsRemaining == 0 ? 0 : static_cast<int>(std::floor(runningCount * 52.0 / cardsRemaining));
+	return std::min(std::max(trueCount, -c_maxTrueCount), c_maxTrueCount) + c_maxTrueCount;
+}
+
+int GetTrueCount(int countBucket)
+{
+	return countBucket - c_maxTrueCount;
+}
+
+// Results for every player hand and dealer upcard, optionally split further by the true count
+// the round was dealt at. A table has either one count bucket, covering every count, or
+// c_trueCountBuckets of them. Each bucket's cells are kept together, so a round only ever
+// touches one bucket's worth.
+class ResultsTable
+{
+public:
+	explicit ResultsTable(int countBuckets = 1);
+
+	int CountBuckets() const { return m_countBuckets; }
+	bool IsCountBucketEmpty(int countBucket) const;
+
+	const ResultsCell& GetCell(int dealerHandIndex, int playerHandIndex, int countBucket = 0) const;
+	void RecordResult(int dealerHandIndex, int playerHandIndex, Action action, double result, int countBucket = 0);
+
+	void Merge(const ResultsTable& other);
+	void MergeCell(int dealerHandIndex, int playerHandIndex, const ResultsCell& cell, int countBucket = 0);
+	void Clear();
+
+	// A one bucket table holding the results for every count
+	ResultsTable CombineCounts() const;
+
+	// Raw cells, so a table can only be loaded into one with the same number of buckets
+	void Save(std::ostream& out) const;
+	bool Load(std::istream& in);
+
+private:
+	static constexpr int c_cellsPerBucket = c_maxPlayerHandIndex * c_maxDealerHandIndex;
+
+	static int CellIndex(int dealerHandIndex, int playerHandIndex, int countBucket);
+
+	int m_countBuckets;
+	std::vector<ResultsCell> m_results;     // [countBucket][playerHandIndex][dealerHandIndex]
+};
+
+ResultsTable::ResultsTable(int countBuckets)
+	: m_countBuckets(countBuckets)
+	, m_results(static_cast<size_t>(countBuckets) * c_cellsPerBucket)
+{ }
+
+int ResultsTable::CellIndex(int dealerHandIndex, int playerHandIndex, int countBucket)
+{
+	return (countBucket * c_maxPlayerHandIndex + playerHandIndex) * c_maxDealerHandIndex + dealerHandIndex;
+}
+
+bool ResultsTable::IsCountBucketEmpty(int countBucket) const
+{
+	for (int i = 0; i < c_cellsPerBucket; i++)
+	{
+		const ResultsCell& cell = m_results[countBucket * c_cellsPerBucket + i];
+		for (int action = 0; action < 4; action++)
+		{
+			if (cell.GetResultData(static_cast<Action>(action)).count != 0)
+				return false;
+		}
+	}
+	return true;
+}
+
+const ResultsCell& ResultsTable::GetCell(int dealerHandIndex, int playerHandIndex, int countBucket) const
+{
+	return m_results[CellIndex(dealerHandIndex, playerHandIndex, countBucket)];
+}
+
+void ResultsTable::RecordResult(int dealerHandIndex, int playerHandIndex, Action action, double result, int countBucket)
+{
+	m_results[CellIndex(dealerHandIndex, playerHandIndex, countBucket)].AddResult(action, result);
+}
+
+void ResultsTable::Merge(const ResultsTable& other)
+{
+	assert(other.m_countBuckets == m_countBuckets);
+	for (size_t i = 0; i < m_results.size(); i++)
+		m_results[i].Merge(other.m_results[i]);
+}
+
+void ResultsTable::MergeCell(int dealerHandIndex, int playerHandIndex, const ResultsCell& cell, int countBucket)
+{
+	m_results[CellIndex(dealerHandIndex, playerHandIndex, countBucket)].Merge(cell);
+}
+
+void ResultsTable::Clear()
+{
+	std::fill(m_results.begin(), m_results.end(), ResultsCell());
+}
+
+ResultsTable ResultsTable::CombineCounts() const
+{
+	ResultsTable combined;
+	for (size_t i = 0; i < m_results.size(); i++)
+		combined.m_results[i % c_cellsPerBucket].Merge(m_results[i]);
+	return combined;
+}
+
+void ResultsTable::Save(std::ostream& out) const
+{
+	static_assert(std::is_trivially_copyable<ResultsCell>::value, "Cells are written raw");
+	out.write(reinterpret_cast<const char*>(m_results.data()), m_results.size() * sizeof(ResultsCell));
+}
+
+bool ResultsTable::Load(std::istream& in)
+{
+	return static_cast<bool>(in.read(reinterpret_cast<char*>(m_results.data()), m_results.size() * sizeof(ResultsCell)));
+}
+
+Action GetOptimalAction(const ResultsTable& resultTable, int dealerHandIndex, int playerHandIndex, uint8_t actionMask, int countBucket = 0)
+{
+	const ResultsCell& cell = resultTable.GetCell(dealerHandIndex, playerHandIndex, countBucket);
+
+	std::array<Action, 4> allActions { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+	Action optimalAction = Action::Stand;
+	double optimalResult = std::numeric_limits<double>::lowest();
+
+	for (Action action : allActions)
+	{
+		const ResultData& data = cell.GetResultData(action);
+		if (data.count == 0 || (actionMask & ActionBit(action)) == 0)
+			continue;
+
+		const double adjustedResult = data.result / data.count;
+
+		if (adjustedResult > optimalResult)
+		{
+			optimalResult = adjustedResult;
+			optimalAction = action;
+		}
+	}
+
+	return optimalAction;
+}
+
+// GetOptimalAction's answer for every cell and action mask a decision can come with, so a
+// decision is a single byte lookup. Built from a ResultsTable, with the same count buckets, and
+// kept current by refreshing each cell the table records into. A bucket's answers take 1240
+// bytes, so the bucket a round is played in stays in cache however many there are.
+class PolicyTable
+{
+public:
+	explicit PolicyTable(const ResultsTable& resultTable) { Rebuild(resultTable); }
+
+	int CountBuckets() const { return static_cast<int>(m_optimalActions.size()) / (c_maxPlayerHandIndex * c_maxDealerHandIndex); }
+	Action GetOptimalAction(int dealerHandIndex, int playerHandIndex, uint8_t actionMask, int countBucket = 0) const;
+
+	void Rebuild(const ResultsTable& resultTable);
+	void Refresh(const ResultsTable& resultTable, int dealerHandIndex, int playerHandIndex, int countBucket = 0);
+
+private:
+	// Decisions are only made while the hand can still hit, and it can always stand, so masks
+	// differ only in whether doubling and splitting are allowed. Those two bits index the masks.
+	static constexpr uint8_t c_alwaysAllowed = ActionBit(Action::Stand) | ActionBit(Action::Hit);
+	static constexpr int c_maskShift = 2;
+	static constexpr int c_actionMaskCount = 4;
+
+	using CellActions = std::array<uint8_t, c_actionMaskCount>;
+
+	static int CellIndex(int dealerHandIndex, int playerHandIndex, int countBucket);
+
+	std::vector<CellActions> m_optimalActions;  // [countBucket][playerHandIndex][dealerHandIndex]
+};
+
+int PolicyTable::CellIndex(int dealerHandIndex, int playerHandIndex, int countBucket)
+{
+	return (countBucket * c_maxPlayerHandIndex + playerHandIndex) * c_maxDealerHandIndex + dealerHandIndex;
+}
+
+Action PolicyTable::GetOptimalAction(int dealerHandIndex, int playerHandIndex, uint8_t actionMask, int countBucket) const
+{
+	assert((actionMask & c_alwaysAllowed) == c_alwaysAllowed);
+	return static_cast<Action>(m_optimalActions[CellIndex(dealerHandIndex, playerHandIndex, countBucket)][actionMask >> c_maskShift]);
+}
+
+void PolicyTable::Rebuild(const ResultsTable& resultTable)
+{
+	m_optimalActions.resize(static_cast<size_t>(resultTable.CountBuckets()) * c_maxPlayerHandIndex * c_maxDealerHandIndex);
+	for (int countBucket = 0; countBucket < resultTable.CountBuckets(); countBucket++)
+	{
+		for (int playerHandIndex = 0; playerHandIndex < c_maxPlayerHandIndex; playerHandIndex++)
+		{
+			for (int dealerHandIndex = 0; dealerHandIndex < c_maxDealerHandIndex; dealerHandIndex++)
+				Refresh(resultTable, dealerHandIndex, playerHandIndex, countBucket);
+		}
+	}
+}
+
+void PolicyTable::Refresh(const ResultsTable& resultTable, int dealerHandIndex, int playerHandIndex, int countBucket)
+{
+	const ResultsCell& cell = resultTable.GetCell(dealerHandIndex, playerHandIndex, countBucket);
+
+	// Actions without results can never be chosen
+	std::array<double, 4> means;
+	for (int action = 0; action < 4; action++)
+	{
+		const ResultData& data = cell.GetResultData(static_cast<Action>(action));
+		means[action] = data.count == 0 ? std::numeric_limits<double>::lowest() : data.result / data.count;
+	}
+
+	// Like GetOptimalAction, a later action only wins with a strictly higher mean, so ties
+	// break the same way
+	auto better = [&](Action current, Action next) { return means[static_cast<int>(next)] > means[static_cast<int>(current)] ? next : current; };
+
+	const Action standOrHit = better(Action::Stand, Action::Hit);
+	const Action withDouble = better(standOrHit, Action::DoubleDown);
+
+	CellActions& optimalActions = m_optimalActions[CellIndex(dealerHandIndex, playerHandIndex, countBucket)];
+	optimalActions[c_alwaysAllowed >> c_maskShift] = static_cast<uint8_t>(standOrHit);
+	optimalActions[(c_alwaysAllowed | ActionBit(Action::DoubleDown)) >> c_maskShift] = static_cast<uint8_t>(withDouble);
+	optimalActions[(c_alwaysAllowed | ActionBit(Action::Split)) >> c_maskShift] = static_cast<uint8_t>(better(standOrHit, Action::Split));
+	optimalActions[(c_alwaysAllowed | ActionBit(Action::DoubleDown) | ActionBit(Action::Split)) >> c_maskShift] = static_cast<uint8_t>(better(withDouble, Action::Split));
+}
+
+template <typename TRules, typename TShoeView>
+void CompletePlayerOptimally(const DealerHand& dealerHand, PlayerHand& hand, const PolicyTable& policy, int countBucket, TShoeView& shoe, Action lastAction)
+{
+	const int dealerHandIndex = MapDealerHandToActionIndex(dealerHand.Showing());
+
+	// Standing or doubling down finishes the hand
+	if (lastAction != Action::Stand && lastAction != Action::DoubleDown)
+	{
+		// Splitting appends sub hands, which this picks up as it goes
+		for (int i = 0; i < hand.SubHandCount(); i++)
+		{
+			PlayerSubHand& subHand = hand.SubHand(i);
+			while (subHand.CanDoAction<TRules>(Action::Hit))
+			{
+				const Action optimalAction = policy.GetOptimalAction(dealerHandIndex, subHand.Info().playerHandIndex, hand.ActionMask<TRules>(subHand), countBucket);
+				DoAction(hand, subHand, optimalAction, shoe);
+
+				if (optimalAction == Action::Stand || optimalAction == Action::DoubleDown)
+					break;
+			}
+		}
+	}
+}
+
+template <typename TRules, typename TShoeView>
+void DrawDealerHand(DealerHand& dealerHand, TShoeView& shoe)
+{
+	dealerHand.FlipHiddenCard();
+	while (TRules::DealerMustHit(dealerHand.Info()))
+	{
+		auto card = shoe.DealCard();
+		dealerHand.AddCard(card);
+	}
+	Trace(c_traceRounds, ThisThreadTrace().Write(TraceEvent::Dealer, { TraceCard(dealerHand.GetCard(0)), TraceCard(dealerHand.GetCard(1)), dealerHand.Value(), dealerHand.CardCount() }));
+}
+
+template <typename TRules>
+double ScoreAgainstDealerHand(const PlayerHand& hand, const DealerHand& dealerHand)
+{
+	double result = 0.0;
+	for (int i = 0; i < hand.SubHandCount(); i++)
+	{
+		const PlayerSubHand& subHand = hand.SubHand(i);
+		const double outcome = GetHandOutcome<TRules>(subHand, dealerHand);
+		result += subHand.Bet() * outcome;
+	}
+
+	return result;
+}
+
+template <typename TRules, typename TShoeView>
+double CompleteDealer(DealerHand& dealerHand, const PlayerHand& hand, TShoeView& shoe)
+{
+	DrawDealerHand<TRules>(dealerHand, shoe);
+	return ScoreAgainstDealerHand<TRules>(hand, dealerHand);
+}
+
+template <typename TRules, typename TShoeView>
+double CompleteOptimally(DealerHand& dealerHand, PlayerHand& hand, const PolicyTable& policy, int countBucket, TShoeView& shoe, Action lastAction)
+{
+	CompletePlayerOptimally<TRules>(dealerHand, hand, policy, countBucket, shoe, lastAction);
+	return CompleteDealer<TRules>(dealerHand, hand, shoe);
+}
+
+// How the dealer's hand can end up. Values 17 - 21 are in order so a total maps straight to its slot.
+enum class DealerFinal
+{
+	Seventeen,
+	Eighteen,
+	Nineteen,
+	Twenty,
+	TwentyOne,
+	Busted,
+	Blackjack,
+};
+
+constexpr int c_dealerFinalCount = 7;
+using DealerOutcomes = std::array<double, c_dealerFinalCount>;
+
+DealerFinal GetDealerFinal(const HandStateInfo& info)
+{
+	if (info.value > 21)
+		return DealerFinal::Busted;
+	else if (info.isBlackjack)
+		return DealerFinal::Blackjack;
+	else
+		return static_cast<DealerFinal>(info.value - 17);
+}
+
+// Every way the dealer can draw to a finished hand from a given upcard, as a graph whose nodes are
+// the sets of cards drawn so far (order doesn't matter to what's left in the shoe). Node 0 is the
+// upcard alone, the hole card is the first draw, and nodes are stored so every edge points forward.
+// Only the hands the dealer still has to hit become nodes, a few hundred of them at most; draws
+// that finish the hand point straight at a DealerFinal instead.
+class DealerDrawGraph
+{
+public:
+	struct Edge
+	{
+		uint8_t  rank;
+		uint8_t  alreadyDrawn;   // Cards of this rank the dealer drew before this one
+		int16_t  target;         // Node index, or ~DealerFinal when the draw finishes the hand
+	};
+
+	struct Node
+	{
+		int      drawnCount;
+		uint32_t firstEdge;
+		uint32_t edgeCount;
+	};
+
+	DealerDrawGraph(int upcardRank, bool hitSoft17);
+
+	std::vector<Node> nodes;
+	std::vector<Edge> edges;
+};
+
+DealerDrawGraph::DealerDrawGraph(int upcardRank, bool hitSoft17)
+{
+	struct PendingNode
+	{
+		HandState state;
+		std::array<uint8_t, c_rankCount> drawn;
+		int drawnCount;
+	};
+
+	std::vector<PendingNode> pending;
+	std::unordered_map<uint64_t, int> nodeByDrawnCards;
+
+	auto packDrawn = [](const std::array<uint8_t, c_rankCount>& drawn) {
+		uint64_t packed = 0;
+		for (int rank = 0; rank < c_rankCount; rank++)
+			packed |= uint64_t(drawn[rank]) << (6 * rank);
+		return packed;
+	};
+
+	pending.push_back({ g_handStates.Next(HandStateTable::c_emptyHand, static_cast<CardFace>(upcardRank)), {}, 0 });
+	nodeByDrawnCards[0] = 0;
+
+	// Breadth first, so nodes come out in order of how many cards have been drawn
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		const PendingNode node = pending[i];
+		nodes.push_back({ node.drawnCount, static_cast<uint32_t>(edges.size()), 0 });
+
+		for (int rank = 0; rank < c_rankCount; rank++)
+		{
+			PendingNode next = node;
+			next.state = g_handStates.Next(node.state, static_cast<CardFace>(rank));
+			next.drawn[rank]++;
+			next.drawnCount++;
+
+			Edge edge = { static_cast<uint8_t>(rank), node.drawn[rank], 0 };
+
+			const HandStateInfo& info = g_handStates.Info(next.state);
+			if (!info.dealerMustHit[hitSoft17])
+			{
+				edge.target = static_cast<int16_t>(~static_cast<int>(GetDealerFinal(info)));
+			}
+			else
+			{
+				auto inserted = nodeByDrawnCards.emplace(packDrawn(next.drawn), static_cast<int>(pending.size()));
+				if (inserted.second)
+					pending.push_back(next);
+				edge.target = static_cast<int16_t>(inserted.first->second);
+			}
+
+			edges.push_back(edge);
+			nodes.back().edgeCount++;
+		}
+	}
+}
+
+// Computes the probability of each way the dealer's hand can finish given the upcard and the ranks
+// left in the shoe, with the hole card still to come out of them. That's a single forward pass
+// over the upcard's DealerDrawGraph, pushing probability along each draw in proportion to how
+// many of that rank are left once the node's cards are gone. An infinite shoe never depletes, so
+// there every draw just uses the shoe's fixed proportions. Finished distributions are cached by
+// upcard and composition, which branches from the same deal often share.
+class DealerOutcomeCache
+{
+public:
+	explicit DealerOutcomeCache(bool hitSoft17)
+		: m_hitSoft17(hitSoft17)
+	{ }
+
+	const DealerOutcomes& Lookup(int upcardRank, const RankCounts& ranks, bool isInfinite, bool excludeBlackjack);
+	DealerOutcomes Compute(int upcardRank, const RankCounts& ranks, bool isInfinite, bool excludeBlackjack);
+
+	static const DealerDrawGraph& Graph(int upcardRank, bool hitSoft17);
+
+private:
+	struct Key
+	{
+		std::array<uint8_t, 16> bytes;
+		bool operator==(const Key& other) const { return bytes == other.bytes; }
+	};
+
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const;
+	};
+
+	static constexpr size_t c_maxEntries = 1 << 18;
+
+	bool m_hitSoft17;
+	std::unordered_map<Key, DealerOutcomes, KeyHash> m_cache;
+	std::vector<double> m_nodeProbabilities;
+};
+
+const DealerDrawGraph& DealerOutcomeCache::Graph(int upcardRank, bool hitSoft17)
+{
+	static const std::array<DealerDrawGraph, c_rankCount> s_standSoft17Graphs = {
+		DealerDrawGraph(0, false), DealerDrawGraph(1, false), DealerDrawGraph(2, false), DealerDrawGraph(3, false), DealerDrawGraph(4, false),
+		DealerDrawGraph(5, false), DealerDrawGraph(6, false), DealerDrawGraph(7, false), DealerDrawGraph(8, false), DealerDrawGraph(9, false),
+	};
+	static const std::array<DealerDrawGraph, c_rankCount> s_hitSoft17Graphs = {
+		DealerDrawGraph(0, true), DealerDrawGraph(1, true), DealerDrawGraph(2, true), DealerDrawGraph(3, true), DealerDrawGraph(4, true),
+		DealerDrawGraph(5, true), DealerDrawGraph(6, true), DealerDrawGraph(7, true), DealerDrawGraph(8, true), DealerDrawGraph(9, true),
+	};
+	return hitSoft17 ? s_hitSoft17Graphs[upcardRank] : s_standSoft17Graphs[upcardRank];
+}
+
+size_t DealerOutcomeCache::KeyHash::operator()(const Key& key) const
+{
+	uint64_t words[2];
+	memcpy(words, key.bytes.data(), sizeof(words));
+	const uint64_t hash = (words[0] ^ (words[1] * 0x9e3779b97f4a7c15)) * 0xbf58476d1ce4e5b9;
+	return static_cast<size_t>(hash ^ (hash >> 32));
+}
+
+const DealerOutcomes& DealerOutcomeCache::Lookup(int upcardRank, const RankCounts& ranks, bool isInfinite, bool excludeBlackjack)
+{
+	Key key = {};
+	for (int rank = 0; rank < c_rankCount; rank++)
+	{
+		assert(ranks[rank] <= UINT8_MAX);
+		key.bytes[rank] = static_cast<uint8_t>(ranks[rank]);
+	}
+	key.bytes[c_rankCount] = static_cast<uint8_t>(upcardRank);
+	key.bytes[c_rankCount + 1] = static_cast<uint8_t>(isInfinite | (excludeBlackjack << 1));
+
+	auto it = m_cache.find(key);
+	if (it != m_cache.end())
+		return it->second;
+
+	// Compositions rarely repeat across shoes, so rather than tracking age just start over when full
+	if (m_cache.size() >= c_maxEntries)
+		m_cache.clear();
+
+	return m_cache.emplace(key, Compute(upcardRank, ranks, isInfinite, excludeBlackjack)).first->second;
+}
+
+DealerOutcomes DealerOutcomeCache::Compute(int upcardRank, const RankCounts& ranks, bool isInfinite, bool excludeBlackjack)
+{
+	const DealerDrawGraph& graph = Graph(upcardRank, m_hitSoft17);
+
+	int cardsRemaining = 0;
+	for (uint16_t count : ranks)
+		cardsRemaining += count;
+
+	// When the dealer has already checked for blackjack, the hole cards which would have made one
+	// are ruled out
+	int holeCardsRemaining = cardsRemaining;
+	if (excludeBlackjack)
+	{
+		for (uint32_t e = 0; e < graph.nodes[0].edgeCount; e++)
+		{
+			const DealerDrawGraph::Edge& edge = graph.edges[graph.nodes[0].firstEdge + e];
+			if (edge.target == ~static_cast<int>(DealerFinal::Blackjack))
+				holeCardsRemaining -= ranks[edge.rank];
+		}
+	}
+
+	m_nodeProbabilities.assign(graph.nodes.size(), 0.0);
+	m_nodeProbabilities[0] = 1.0;
+
+	DealerOutcomes outcomes = {};
+	for (size_t n = 0; n < graph.nodes.size(); n++)
+	{
+		const DealerDrawGraph::Node& node = graph.nodes[n];
+		const double nodeProbability = m_nodeProbabilities[n];
+		if (nodeProbability == 0.0)
+			continue;
+
+		const int drawFrom = (n == 0) ? holeCardsRemaining : (isInfinite ? cardsRemaining : cardsRemaining - node.drawnCount);
+		const double scale = nodeProbability / drawFrom;
+
+		for (uint32_t e = 0; e < node.edgeCount; e++)
+		{
+			const DealerDrawGraph::Edge& edge = graph.edges[node.firstEdge + e];
+			const int count = isInfinite ? ranks[edge.rank] : ranks[edge.rank] - edge.alreadyDrawn;
+			if (count <= 0 || (n == 0 && excludeBlackjack && edge.target == ~static_cast<int>(DealerFinal::Blackjack)))
+				continue;
+
+			const double probability = scale * count;
+			if (edge.target >= 0)
+				m_nodeProbabilities[edge.target] += probability;
+			else
+				outcomes[~edge.target] += probability;
+		}
+	}
+
+	return outcomes;
+}
+
+// The expected payout of a finished hand against every way the dealer might finish, matching GetHandOutcome
+template <typename TRules>
+double GetExpectedHandOutcome(const HandStateInfo& playerHand, const DealerOutcomes& dealerOutcomes)
+{
+	if (playerHand.value > 21)
+		return -1;
+
+	double result = 0.0;
+	for (int i = 0; i < c_dealerFinalCount; i++)
+	{
+		const DealerFinal dealerFinal = static_cast<DealerFinal>(i);
+		double outcome;
+
+		if (dealerFinal == DealerFinal::Blackjack)
+			outcome = playerHand.isBlackjack ? 0.0 : -1.0;
+		else if (playerHand.isBlackjack)
+			outcome = TRules::c_blackjackPayout;
+		else if (dealerFinal == DealerFinal::Busted)
+			outcome = 1.0;
+		else
+		{
+			const int dealerValue = 17 + i;
+			outcome = playerHand.value > dealerValue ? 1.0 : playerHand.value == dealerValue ? 0.0 : -1.0;
+		}
+
+		result += dealerOutcomes[i] * outcome;
+	}
+
+	return result;
+}
+
+// How the dealer's hand can finish from the shoe as it stands. The hole card is treated as unknown,
+// so it goes back into the composition the distribution is computed from. Rounds only get this
+// far when the dealer doesn't have blackjack, so that's ruled out.
+template <typename TShoeView>
+const DealerOutcomes& GetDealerOutcomes(const DealerHand& dealerHand, const TShoeView& shoe, DealerOutcomeCache& dealerOutcomeCache)
+{
+	RankCounts ranks = shoe.RemainingRanks();
+	if (!shoe.IsInfinite())
+		ranks[GetRank(dealerHand.GetCard(0))]++;
+
+	return dealerOutcomeCache.Lookup(GetRank(dealerHand.GetCard(1)), ranks, shoe.IsInfinite(), true);
+}
+
+// Scores the player's finished hands against the distribution of dealer outcomes rather than
+// drawing the dealer's cards
+template <typename TRules>
+double ScoreAgainstDealerOutcomes(const PlayerHand& hand, const DealerOutcomes& dealerOutcomes)
+{
+	double result = 0.0;
+	for (int i = 0; i < hand.SubHandCount(); i++)
+	{
+		const PlayerSubHand& subHand = hand.SubHand(i);
+		result += subHand.Bet() * GetExpectedHandOutcome<TRules>(subHand.Info(), dealerOutcomes);
+	}
+
+	return result;
+}
+
+template <typename TRules, typename TShoeView>
+double ScoreAgainstDealerOutcomes(const DealerHand& dealerHand, const PlayerHand& hand, const TShoeView& shoe, DealerOutcomeCache& dealerOutcomeCache)
+{
+	return ScoreAgainstDealerOutcomes<TRules>(hand, GetDealerOutcomes(dealerHand, shoe, dealerOutcomeCache));
+}
+
+// Computes the exact expectation of every action in every results table cell, under the same
+// RuleSet as the simulation. As in the simulation the dealer checks for blackjack, and a two card
+// 21 pays the blackjack payout even after a split. Two simplifications: a split is valued as twice
+// one of its hands, and split hands aren't resplit.
+//
+// Rather than sampling, every hand is expanded over the ranks left in the shoe and memoized on
+// the cards it has taken out of the shoe plus its hand state. The hole card stays among the
+// unseen cards (by symmetry it doesn't matter when it's drawn). Under an ace or ten the dealer
+// has peeked, so it can't be a card that makes blackjack, and every draw and dealer outcome is
+// conditioned on that. The player still doesn't see it, so each decision is made on the
+// expectation over every hole card it could be.
+template <typename TRules>
+class ExactEvEngine
+{
+public:
+	ExactEvEngine(int deckCount);
+
+	ResultsTable Compute();
+
+private:
+	enum class EvKind
+	{
+		Stand,
+		BestAfterHit,   // Stand or hit
+		BestFromSplit,  // Stand, hit or double, no resplitting
+	};
+
+	void ComputeUpcard(int upcardRank);
+
+	double StandEv(uint64_t removed, HandState state);
+	double HitEv(uint64_t removed, HandState state);
+	double DoubleEv(uint64_t removed, HandState state);
+	double SplitEv(int pairRank);
+	double BestEv(uint64_t removed, HandState state, EvKind kind);
+
+	RankCounts Unseen(uint64_t removed) const;
+	std::array<double, c_rankCount> DrawOdds(uint64_t removed) const;
+
+	// Memo keys pack the count removed of each rank into 5 bits, enough for every ace in a hand,
+	// then the hand state and the EvKind
+	static constexpr int c_rankBits = 5;
+	static constexpr int c_stateShift = c_rankBits * c_rankCount;
+	static constexpr int c_kindShift = 62;
+
+	static uint64_t RankBit(int rank) { return uint64_t(1) << (c_rankBits * rank); }
+	static int RemovedCount(uint64_t removed, int rank) { return static_cast<int>((removed >> (c_rankBits * rank)) & ((1 << c_rankBits) - 1)); }
+	static uint64_t MemoKey(uint64_t removed, HandState state, EvKind kind) { return removed | (uint64_t(state) << c_stateShift) | (uint64_t(kind) << c_kindShift); }
+
+	RankCounts m_fullShoe;
+	int m_cardsPerFace;
+
+	// The upcard being computed, and the hole cards its peek rules out
+	int m_upcardRank = 0;
+	std::array<bool, c_rankCount> m_holeRuledOut = {};
+	RankCounts m_shoeAfterDeal;   // Everything but the upcard
+
+	std::unordered_map<uint64_t, double> m_memo;
+	DealerOutcomeCache m_dealerOutcomes;
+
+	// Accumulated expectation and weight per cell and action
+	std::array<std::array<std::array<double, 4>, c_maxDealerHandIndex>, c_maxPlayerHandIndex> m_weightedEv = {};
+	std::array<std::array<std::array<double, 4>, c_maxDealerHandIndex>, c_maxPlayerHandIndex> m_weight = {};
+};
+
+template <typename TRules>
+ExactEvEngine<TRules>::ExactEvEngine(int deckCount)
+	: m_cardsPerFace(4 * deckCount)
+	, m_dealerOutcomes(TRules::c_hitSoft17)
+{
+	m_fullShoe.fill(static_cast<uint16_t>(m_cardsPerFace));
+	m_fullShoe[c_rankCount - 1] = static_cast<uint16_t>(4 * m_cardsPerFace);
+	assert(g_handStates.StateCount() <= (uint64_t(1) << (c_kindShift - c_stateShift)));
+}
+
+template <typename TRules>
+ResultsTable ExactEvEngine<TRules>::Compute()
+{
+	for (int upcardRank = 0; upcardRank < c_rankCount; upcardRank++)
+		ComputeUpcard(upcardRank);
+
+	ResultsTable results;
+	constexpr std::array<Action, 4> allActions { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+
+	for (int playerHandIndex = 0; playerHandIndex < c_maxPlayerHandIndex; playerHandIndex++)
+	{
+		for (int dealerHandIndex = 0; dealerHandIndex < c_maxDealerHandIndex; dealerHandIndex++)
+		{
+			for (Action action : allActions)
+			{
+				const int a = static_cast<int>(action);
+				const double weight = m_weight[playerHandIndex][dealerHandIndex][a];
+				if (weight > 0)
+					results.RecordResult(dealerHandIndex, playerHandIndex, action, m_weightedEv[playerHandIndex][dealerHandIndex][a] / weight);
+			}
+		}
+	}
+
+	return results;
+}
+
+template <typename TRules>
+void ExactEvEngine<TRules>::ComputeUpcard(int upcardRank)
+{
+	m_upcardRank = upcardRank;
+	m_shoeAfterDeal = m_fullShoe;
+	m_shoeAfterDeal[upcardRank]--;
+	m_memo.clear();
+
+	const HandState upcardState = g_handStates.Next(HandStateTable::c_emptyHand, static_cast<CardFace>(upcardRank));
+	for (int rank = 0; rank < c_rankCount; rank++)
+		m_holeRuledOut[rank] = g_handStates.Info(g_handStates.Next(upcardState, static_cast<CardFace>(rank))).isBlackjack;
+
+	const int dealerHandIndex = MapDealerHandToActionIndex(Card(upcardRank).Value());
+
+	// Both player cards are dealt by face, as that's what decides whether they're a pair
+	int shoeSize = 0;
+	int holeCandidates = 0;
+	for (int rank = 0; rank < c_rankCount; rank++)
+	{
+		shoeSize += m_shoeAfterDeal[rank];
+		if (!m_holeRuledOut[rank])
+			holeCandidates += m_shoeAfterDeal[rank];
+	}
+
+	for (int firstFace = 0; firstFace < 13; firstFace++)
+	{
+		for (int secondFace = 0; secondFace < 13; secondFace++)
+		{
+			const int firstRank = GetRank(Card(firstFace));
+			const int secondRank = GetRank(Card(secondFace));
+
+			// Cards of a face still in the shoe. A dealt ten could have been any of the ten faces, so
+			// it's taken out of all four evenly.
+			auto faceCount = [&](int rank) {
+				return rank < c_rankCount - 1 ? m_shoeAfterDeal[rank] : m_shoeAfterDeal[rank] / 4.0;
+			};
+
+			const double firstCount = faceCount(firstRank);
+			double secondCount = faceCount(secondRank);
+			if (firstFace == secondFace)
+				secondCount -= 1;
+			if (firstCount <= 0 || secondCount <= 0)
+				continue;
+
+			// The deal is conditioned on the peek finding no blackjack, which is likelier the more
+			// of the hole cards it allows are left once the player's cards are out
+			const int holeCandidatesLeft = holeCandidates - !m_holeRuledOut[firstRank] - !m_holeRuledOut[secondRank];
+			const double holeWeight = (static_cast<double>(holeCandidatesLeft) / (shoeSize - 2)) / (static_cast<double>(holeCandidates) / shoeSize);
+			const double handWeight = holeWeight * (firstCount / shoeSize) * (secondCount / (shoeSize - 1));
+
+			HandState state = g_handStates.Next(HandStateTable::c_emptyHand, static_cast<CardFace>(firstFace));
+			state = g_handStates.Next(state, static_cast<CardFace>(secondFace));
+			const HandStateInfo& info = g_handStates.Info(state);
+
+			// Player blackjacks never get to act
+			if (info.isBlackjack)
+				continue;
+
+			// Within a rank the faces only matter for pairing, so carry on by rank
+			const HandState rankState = g_handStates.Next(g_handStates.Next(HandStateTable::c_emptyHand, static_cast<CardFace>(firstRank)), static_cast<CardFace>(secondRank));
+			const uint64_t removed = RankBit(firstRank) + RankBit(secondRank);
+
+			auto record = [&](Action action, double ev) {
+				const int a = static_cast<int>(action);
+				m_weightedEv[info.playerHandIndex][dealerHandIndex][a] += handWeight * ev;
+				m_weight[info.playerHandIndex][dealerHandIndex][a] += handWeight;
+			};
+
+			const uint8_t actionMask = TRules::ActionMask(info);
+			record(Action::Stand, StandEv(removed, rankState));
+			if (actionMask & ActionBit(Action::Hit))
+				record(Action::Hit, HitEv(removed, rankState));
+			if (actionMask & ActionBit(Action::DoubleDown))
+				record(Action::DoubleDown, DoubleEv(removed, rankState));
+			if (actionMask & ActionBit(Action::Split))
+				record(Action::Split, SplitEv(firstRank));
+		}
+	}
+}
+
+template <typename TRules>
+RankCounts ExactEvEngine<TRules>::Unseen(uint64_t removed) const
+{
+	RankCounts unseen = m_shoeAfterDeal;
+	for (int rank = 0; rank < c_rankCount; rank++)
+		unseen[rank] = static_cast<uint16_t>(unseen[rank] - RemovedCount(removed, rank));
+	return unseen;
+}
+
+// The chance of each rank being the next card out of the shoe. The hole card is one of the unseen
+// cards but can't be one the peek ruled out, so those ranks are a little likelier to come out of
+// the shoe than their share of the unseen cards, and the rest a little less.
+template <typename TRules>
+std::array<double, c_rankCount> ExactEvEngine<TRules>::DrawOdds(uint64_t removed) const
+{
+	const RankCounts unseen = Unseen(removed);
+	int unseenCount = 0;
+	int holeCandidates = 0;
+	for (int rank = 0; rank < c_rankCount; rank++)
+	{
+		unseenCount += unseen[rank];
+		if (!m_holeRuledOut[rank])
+			holeCandidates += unseen[rank];
+	}
+
+	// Whatever the hole card is, the next card is one of the others
+	std::array<double, c_rankCount> odds;
+	for (int rank = 0; rank < c_rankCount; rank++)
+	{
+		const double holeChance = m_holeRuledOut[rank] ? 0.0 : static_cast<double>(unseen[rank]) / holeCandidates;
+		odds[rank] = (unseen[rank] - holeChance) / (unseenCount - 1);
+	}
+	return odds;
+}
+
+template <typename TRules>
+double ExactEvEngine<TRules>::StandEv(uint64_t removed, HandState state)
+{
+	const HandStateInfo& info = g_handStates.Info(state);
+	if (info.value > 21)
+		return -1;
+
+	const uint64_t key = MemoKey(removed, state, EvKind::Stand);
+	auto it = m_memo.find(key);
+	if (it != m_memo.end())
+		return it->second;
+
+	const DealerOutcomes dealerOutcomes = m_dealerOutcomes.Compute(m_upcardRank, Unseen(removed), false, true);
+	const double ev = GetExpectedHandOutcome<TRules>(info, dealerOutcomes);
+
+	m_memo.emplace(key, ev);
+	return ev;
+}
+
+template <typename TRules>
+double ExactEvEngine<TRules>::HitEv(uint64_t removed, HandState state)
+{
+	const std::array<double, c_rankCount> odds = DrawOdds(removed);
+
+	double ev = 0.0;
+	for (int rank = 0; rank < c_rankCount; rank++)
+	{
+		if (odds[rank] <= 0)
+			continue;
+
+		const HandState next = g_handStates.Next(state, static_cast<CardFace>(rank));
+		ev += odds[rank] * BestEv(removed + RankBit(rank), next, EvKind::BestAfterHit);
+	}
+	return ev;
+}
+
+template <typename TRules>
+double ExactEvEngine<TRules>::DoubleEv(uint64_t removed, HandState state)
+{
+	const std::array<double, c_rankCount> odds = DrawOdds(removed);
+
+	double ev = 0.0;
+	for (int rank = 0; rank < c_rankCount; rank++)
+	{
+		if (odds[rank] <= 0)
+			continue;
+
+		const HandState next = g_handStates.Next(state, static_cast<CardFace>(rank));
+		ev += odds[rank] * StandEv(removed + RankBit(rank), next);
+	}
+	return 2 * ev;
+}
+
+template <typename TRules>
+double ExactEvEngine<TRules>::SplitEv(int pairRank)
+{
+	// One of the two hands, with its partner's card out of the shoe too
+	const uint64_t removed = 2 * RankBit(pairRank);
+	const HandState splitState = g_handStates.SplitHand(static_cast<CardFace>(pairRank));
+
+	const std::array<double, c_rankCount> odds = DrawOdds(removed);
+
+	double ev = 0.0;
+	for (int rank = 0; rank < c_rankCount; rank++)
+	{
+		if (odds[rank] <= 0)
+			continue;
+
+		const HandState next = g_handStates.Next(splitState, static_cast<CardFace>(rank));
+		ev += odds[rank] * BestEv(removed + RankBit(rank), next, EvKind::BestFromSplit);
+	}
+	return 2 * ev;
+}
+
+template <typename TRules>
+double ExactEvEngine<TRules>::BestEv(uint64_t removed, HandState state, EvKind kind)
+{
+	const HandStateInfo& info = g_handStates.Info(state);
+	if (info.value > 21)
+		return -1;
+
+	const uint64_t key = MemoKey(removed, state, kind);
+	auto it = m_memo.find(key);
+	if (it != m_memo.end())
+		return it->second;
+
+	const uint8_t actionMask = TRules::ActionMask(info);
+	double ev = StandEv(removed, state);
+	if (actionMask & ActionBit(Action::Hit))
+		ev = std::max(ev, HitEv(removed, state));
+	if (kind == EvKind::BestFromSplit && (actionMask & ActionBit(Action::DoubleDown)))
+		ev = std::max(ev, DoubleEv(removed, state));
+
+	m_memo.emplace(key, ev);
+	return ev;
+}
+
+// Pass confidenceZ to print each mean's confidence interval half width next to it
+void PrintResultsTable(const ResultsTable& results, double confidenceZ = 0.0, int countBucket = 0)
+{
+	constexpr std::array<Action, 4> allActions = { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+
+	for (int i=0; i < c_maxPlayerHandIndex; i++)
+	{
+		for (Action a : allActions)
+		{
+			for (int j = 0; j < c_maxDealerHandIndex; j++)
+			{
+				const ResultsCell& cell = results.GetCell(j, i, countBucket);
+				const ResultData& data = cell.GetResultData(a);
+
+				if (data.count == 0)
+					std::cout << "";
+				else
+					std::cout << data.result / data.count;
+
+				if (data.count != 0 && confidenceZ > 0)
+					std::cout << " +/- " << confidenceZ * data.StandardError();
+
+				std::cout << "\t";
+			}
+			std::cout << "\n";
+		}
+	}
+}
+
+// The two sided normal quantile for a confidence level, e.g. 1.96 for 0.95
+double GetConfidenceZ(double confidence)
+{
+	double low = 0.0;
+	double high = 40.0;
+	for (int i = 0; i < 100; i++)
+	{
+		const double mid = (low + high) / 2;
+		if (std::erfc(mid / std::sqrt(2.0)) > 1.0 - confidence)
+			low = mid;
+		else
+			high = mid;
+	}
+	return (low + high) / 2;
+}
+
+// Every action needs this many samples before its standard error means much
+constexpr int c_minSamplesForConfidence = 30;
+
+// A cell is resolved once its best action is separated from the runner up at the given z, or
+// the difference between them is known to within tolerance either way (so they're close enough
+// not to matter). Cells nobody has visited don't count against the table.
+bool IsCellResolved(const ResultsCell& cell, double confidenceZ, double tolerance)
+{
+	constexpr std::array<Action, 4> allActions = { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+
+	const ResultData* best = nullptr;
+	const ResultData* runnerUp = nullptr;
+	bool isVisited = false;
+
+	for (Action action : allActions)
+	{
+		const ResultData& data = cell.GetResultData(action);
+		if (data.count == 0)
+			continue;
+
+		isVisited = true;
+		if (data.count < c_minSamplesForConfidence)
+			return false;
+
+		if (best == nullptr || data.Mean() > best->Mean())
+		{
+			runnerUp = best;
+			best = &data;
+		}
+		else if (runnerUp == nullptr || data.Mean() > runnerUp->Mean())
+		{
+			runnerUp = &data;
+		}
+	}
+
+	if (!isVisited || runnerUp == nullptr)
+		return true;
+
+	const double difference = best->Mean() - runnerUp->Mean();
+	const double halfWidth = confidenceZ * std::sqrt(best->StandardError() * best->StandardError() + runnerUp->StandardError() * runnerUp->StandardError());
+
+	return difference > halfWidth || halfWidth < tolerance;
+}
+
+int CountUnresolvedCells(const ResultsTable& results, double confidenceZ, double tolerance)
+{
+	int unresolvedCells = 0;
+	for (int countBucket = 0; countBucket < results.CountBuckets(); countBucket++)
+	{
+		for (int i = 0; i < c_maxPlayerHandIndex; i++)
+		{
+			for (int j = 0; j < c_maxDealerHandIndex; j++)
+			{
+				if (!IsCellResolved(results.GetCell(j, i, countBucket), confidenceZ, tolerance))
+					unresolvedCells++;
+			}
+		}
+	}
+	return unresolvedCells;
+}
+
+std::string GetPlayerHandLabel(int playerHandIndex)
+{
+	// See HandStateTable::Describe for the layout
+	if (playerHandIndex == 0)
+		return "Hard 8 or less";
+	else if (playerHandIndex <= 12)
+		return "Hard " + std::to_string(playerHandIndex + 8);
+	else if (playerHandIndex <= 20)
+		return "Soft " + std::to_string(playerHandIndex);
+	else if (playerHandIndex == 21)
+		return "Pair A";
+	else
+		return "Pair " + std::to_string(playerHandIndex - 20);
+}
+
+std::string GetDealerUpcardLabel(int dealerHandIndex)
+{
+	// See MapDealerHandToActionIndex
+	return dealerHandIndex == 9 ? "A" : std::to_string(dealerHandIndex + 2);
+}
+
+enum class SnapshotFormat
+{
+	Csv,        // One row per visited cell and action, with the rounds played so far
+	Json,       // One JSON object per snapshot per line
+	Binary,     // Fixed size records, see SnapshotWriter::WriteBinary
+};
+
+// Appends snapshots of the results table to a file from a background thread. Submit only copies
+// the table, so the simulation never waits on the disk. If the writer falls behind, a newer
+// snapshot replaces the one still waiting, so a slow disk drops intermediate snapshots rather
+// than stalling anything.
+class SnapshotWriter
+{
+public:
+	SnapshotWriter(const std::string& path, SnapshotFormat format, bool append);
+	~SnapshotWriter();
+
+	SnapshotWriter(const SnapshotWriter&) = delete;
+	SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+	bool IsOpen() const { return static_cast<bool>(m_out); }
+	void Submit(const ResultsTable& table, int roundsPlayed);
+
+private:
+	void Run();
+	void Write(const ResultsTable& table, int roundsPlayed);
+	void WriteCsv(const ResultsTable& table, int roundsPlayed);
+	void WriteJson(const ResultsTable& table, int roundsPlayed);
+	void WriteBinary(const ResultsTable& table, int roundsPlayed);
+
+	std::ofstream m_out;
+	SnapshotFormat m_format;
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::unique_ptr<ResultsTable> m_pendingTable;
+	int m_pendingRounds = 0;
+	bool m_hasPending = false;
+	bool m_isDone = false;
+	std::thread m_thread;
+};
+
+// Appending continues the history of a resumed run rather than starting the file over
+SnapshotWriter::SnapshotWriter(const std::string& path, SnapshotFormat format, bool append)
+	: m_out(path, std::ios::binary | (append ? std::ios::app : std::ios::trunc))
+	, m_format(format)
+{
+	if (m_format == SnapshotFormat::Csv && m_out && m_out.tellp() == 0)
+		m_out << "rounds,player,dealer,action,count,mean,stderr\n";
+
+	m_thread = std::thread(&SnapshotWriter::Run, this);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isDone = true;
+	}
+	m_condition.notify_one();
+	m_thread.join();
+}
+
+void SnapshotWriter::Submit(const ResultsTable& table, int roundsPlayed)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_pendingTable)
+			m_pendingTable = std::make_unique<ResultsTable>();
+
+		// Snapshots cover every count at once
+		if (table.CountBuckets() > 1)
+			*m_pendingTable = table.CombineCounts();
+		else
+			*m_pendingTable = table;
+		m_pendingRounds = roundsPlayed;
+		m_hasPending = true;
+	}
+	m_condition.notify_one();
+}
+
+void SnapshotWriter::Run()
+{
+	// Swapped with the pending table, so neither side allocates once both exist
+	std::unique_ptr<ResultsTable> table;
+
+	for (;;)
+	{
+		int roundsPlayed;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [&] { return m_hasPending || m_isDone; });
+
+			// Anything still pending is written before finishing, so the last snapshot is never lost
+			if (!m_hasPending)
+				return;
+
+			std::swap(table, m_pendingTable);
+			roundsPlayed = m_pendingRounds;
+			m_hasPending = false;
+		}
+
+		Write(*table, roundsPlayed);
+	}
+}
+
+void SnapshotWriter::Write(const ResultsTable& table, int roundsPlayed)
+{
+	switch (m_format)
+	{
+		case SnapshotFormat::Csv:
+			WriteCsv(table, roundsPlayed);
+			break;
+		case SnapshotFormat::Json:
+			WriteJson(table, roundsPlayed);
+			break;
+		case SnapshotFormat::Binary:
+			WriteBinary(table, roundsPlayed);
+			break;
+	}
+
+	m_out.flush();
+}
+
+void SnapshotWriter::WriteCsv(const ResultsTable& table, int roundsPlayed)
+{
+	constexpr std::array<Action, 4> allActions = { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+
+	for (int i = 0; i < c_maxPlayerHandIndex; i++)
+	{
+		for (int j = 0; j < c_maxDealerHandIndex; j++)
+		{
+			for (Action action : allActions)
+			{
+				const ResultData& data = table.GetCell(j, i).GetResultData(action);
+				if (data.count == 0)
+					continue;
+
+				m_out << roundsPlayed << "," << GetPlayerHandLabel(i) << "," << GetDealerUpcardLabel(j) << "," << GetActionString(action)
+					<< "," << data.count << "," << data.Mean() << "," << data.StandardError() << "\n";
+			}
+		}
+	}
+}
+
+void SnapshotWriter::WriteJson(const ResultsTable& table, int roundsPlayed)
+{
+	constexpr std::array<Action, 4> allActions = { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+
+	m_out << "{\"rounds\":" << roundsPlayed << ",\"cells\":[";
+
+	bool isFirstCell = true;
+	for (int i = 0; i < c_maxPlayerHandIndex; i++)
+	{
+		for (int j = 0; j < c_maxDealerHandIndex; j++)
+		{
+			const ResultsCell& cell = table.GetCell(j, i);
+
+			bool isFirstAction = true;
+			for (Action action : allActions)
+			{
+				const ResultData& data = cell.GetResultData(action);
+				if (data.count == 0)
+					continue;
+
+				if (isFirstAction)
+				{
+					m_out << (isFirstCell ? "" : ",") << "{\"player\":\"" << GetPlayerHandLabel(i) << "\",\"dealer\":\"" << GetDealerUpcardLabel(j) << "\",\"actions\":{";
+					isFirstCell = false;
+				}
+
+				m_out << (isFirstAction ? "" : ",") << "\"" << GetActionString(action) << "\":{\"count\":" << data.count
+					<< ",\"mean\":" << data.Mean() << ",\"stderr\":" << data.StandardError() << "}";
+				isFirstAction = false;
+			}
+
+			if (!isFirstAction)
+				m_out << "}}";
+		}
+	}
+
+	m_out << "]}\n";
+}
+
+// Each snapshot is the magic "BJSS", a uint32 version, an int64 round count, then for every
+// player hand, upcard and action (Stand, Hit, DoubleDown, Split) in table order, an int64 count
+// and a double mean. Everything is little endian, with no padding.
+constexpr uint32_t c_binarySnapshotVersion = 1;
+
+void SnapshotWriter::WriteBinary(const ResultsTable& table, int roundsPlayed)
+{
+	constexpr std::array<Action, 4> allActions = { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+
+	m_out.write("BJSS", 4);
+	WriteRaw(m_out, c_binarySnapshotVersion);
+	WriteRaw(m_out, int64_t(roundsPlayed));
+
+	for (int i = 0; i < c_maxPlayerHandIndex; i++)
+	{
+		for (int j = 0; j < c_maxDealerHandIndex; j++)
+		{
+			for (Action action : allActions)
+			{
+				const ResultData& data = table.GetCell(j, i).GetResultData(action);
+				WriteRaw(m_out, data.count);
+				WriteRaw(m_out, data.count == 0 ? 0.0 : data.Mean());
+			}
+		}
+	}
+}
+
+enum class ShoeType
+{
+	Shuffled,       // Deal from a shuffled vector of cards
+	Composition,    // Draw from the remaining count of each face
+	Infinite,       // Every face always equally likely
+};
+
+// How each round's starting cards are chosen
+enum class DealMode
+{
+	Natural,        // Straight from the shoe
+	Stratified,     // Cycle through every player hand and upcard equally
+	Adaptive,       // Only deal the player hands and upcards whose best action isn't settled yet
+};
+
+// What --adaptive calls settled without --confidence
+constexpr double c_defaultAdaptiveConfidence = 0.95;
+
+struct SimulationOptions
+{
+	int iterations = 1'000'000;
+	uint64_t seed = 0;
+	bool hasSeed = false;
+	int threads = 1;            // 0 = one per hardware thread
+	int syncInterval = 10'000;  // rounds each worker plays between shard merges
+	ShoeType shoeType = ShoeType::Shuffled;
+	TableRules rules;
+	bool exactDealer = false;   // Score against the dealer's outcome distribution instead of drawing
+	int batchLanes = 0;         // When set, each worker plays this many rounds at once with BatchMarkovMonteWorker
+	bool trueCount = false;     // Split the results by the true count each round was dealt at
+	DealMode dealMode = DealMode::Natural;
+	std::string shardPath;      // Where to write the finished table as a mergeable shard, if anywhere
+	std::vector<std::string> mergePaths;    // Shards to merge instead of simulating
+	bool exactEv = false;       // Compute the table exactly instead of simulating
+	double confidence = 0.0;    // When set, stop once every visited cell's best action is resolved at this confidence
+	double ciTolerance = 0.0;   // Treat actions as tied once their difference is known to within this
+	std::string checkpointPath;     // Where to checkpoint the run, if anywhere
+	int checkpointRounds = 0;       // Checkpoint after this many rounds...
+	double checkpointSeconds = 0.0; // ...or this many seconds, whichever comes first (60 seconds if neither is set)
+	bool resume = false;            // Continue from the checkpoint at checkpointPath
+	std::string snapshotPath;       // Where to stream snapshots of the table, if anywhere
+	SnapshotFormat snapshotFormat = SnapshotFormat::Csv;
+	int snapshotRounds = 100'000;   // Rounds between snapshots
+	bool stats = false;             // Count what the run is doing and report it
+	double statsSeconds = 10.0;     // Seconds between stats reports
+	int sessions = 0;               // When set, play this many bankroll sessions with a frozen policy instead of simulating
+	std::string policyPath;         // The shard whose best actions the sessions play
+	std::string advisePath;         // When set, answer strategy queries from this shard instead of simulating
+	std::string queriesPath;        // Binary queries to answer, rather than text on stdin
+	std::string answersPath;        // Where the answers to binary queries go
+	int sessionHands = 1'000;       // Hands per session, unless the bankroll runs out first
+	double bankroll = 100.0;        // Each session's starting bankroll, in minimum bets
+	std::vector<std::pair<int, int>> betSpread;     // (true count, bet) pairs in count order, betting one below all of them
+	std::string tracePath;          // Write the trace here once the run is over, in tracing builds
+	std::string decodeTracePath;    // When set, print this trace as text instead of simulating
+	std::string corpusPath;         // Deal the shuffled shoes from this corpus, if anywhere
+	std::string writeCorpusPath;    // Write a corpus here instead of simulating
+	int corpusShoes = 100'000;      // Shoes to write to it
+};
+
+// The seed given, or a random one
+uint64_t ChooseSeed(const SimulationOptions& options)
+{
+	return options.hasSeed ? options.seed : (uint64_t(std::random_device{}()) << 32) | std::random_device{}();
+}
+
+int GetCountBuckets(const SimulationOptions& options)
+{
+	return options.trueCount ? c_trueCountBuckets : 1;
+}
+
+// Counters behind --stats. Each worker counts into its own, and they're only summed to report
+// them, so counting never touches shared state.
+struct RunStats
+{
+	int64_t rounds = 0;
+	int64_t cardsDealt = 0;         // Cards taken from the shoe, not counting cards branches dealt and rolled back
+	int64_t reloads = 0;
+	int64_t branches[4] = {};       // Branches evaluated per Action
+	int64_t splits = 0;             // Splits made, over every branch
+	int64_t blackjackExits = 0;     // Rounds over at the deal because someone had blackjack
+	double playerSeconds = 0.0;     // Playing out the player's hands in each branch
+	double dealerSeconds = 0.0;     // Completing or scoring the dealer
+	double tableSeconds = 0.0;      // Recording results
+
+	void Merge(const RunStats& other);
+};
+
+void RunStats::Merge(const RunStats& other)
+{
+	rounds += other.rounds;
+	cardsDealt += other.cardsDealt;
+	reloads += other.reloads;
+	for (int i = 0; i < 4; i++)
+		branches[i] += other.branches[i];
+	splits += other.splits;
+	blackjackExits += other.blackjackExits;
+	playerSeconds += other.playerSeconds;
+	dealerSeconds += other.dealerSeconds;
+	tableSeconds += other.tableSeconds;
+}
+
+void PrintRunStats(const RunStats& stats, double elapsedSeconds)
+{
+	const double phaseSeconds = std::max(1e-9, stats.playerSeconds + stats.dealerSeconds + stats.tableSeconds);
+
+	std::cerr << "After " << elapsedSeconds << "s: " << stats.rounds << " rounds (" << static_cast<int64_t>(stats.rounds / std::max(1e-9, elapsedSeconds)) << "/s), "
+		<< stats.cardsDealt << " cards dealt, " << stats.reloads << " reloads, " << stats.blackjackExits << " blackjack exits, " << stats.splits << " splits\n";
+	std::cerr << "  Branches: " << stats.branches[0] << " stand, " << stats.branches[1] << " hit, " << stats.branches[2] << " double, " << stats.branches[3] << " split\n";
+	std::cerr << "  Time: player " << 100 * stats.playerSeconds / phaseSeconds << "%, dealer " << 100 * stats.dealerSeconds / phaseSeconds
+		<< "%, table " << 100 * stats.tableSeconds / phaseSeconds << "% (" << phaseSeconds << "s over all threads)\n";
+}
+
+// Blocks until every participant has arrived, then runs onComplete on the last thread
+// to arrive before releasing the others.
+class SyncBarrier
+{
+public:
+	SyncBarrier(int participants)
+		: m_participants(participants)
+	{ }
+
+	template <typename TFunc>
+	void ArriveAndWait(TFunc&& onComplete);
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	int m_participants;
+	int m_waiting = 0;
+	int m_generation = 0;
+};
+
+template <typename TFunc>
+void SyncBarrier::ArriveAndWait(TFunc&& onComplete)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	const int generation = m_generation;
+
+	if (++m_waiting == m_participants)
+	{
+		onComplete();
+		m_waiting = 0;
+		m_generation++;
+		m_condition.notify_all();
+	}
+	else
+	{
+		m_condition.wait(lock, [&] { return m_generation != generation; });
+	}
+}
+
+// A checkpoint is this header, then the merged ResultsTable, then each worker's shoe in worker
+// order, all written raw. A run can only resume from a checkpoint written by the same build
+// with the same shoe, dealer mode, thread count, sync interval and rules, which is what makes the
+// rest of the run replay exactly as it would have without the interruption.
+struct CheckpointHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t tableSize;
+	int32_t shoeType;
+	int32_t threadCount;
+	int32_t syncInterval;
+	int32_t exactDealer;
+	int32_t batchLanes;
+	int32_t countBuckets;
+	int32_t dealMode;
+	int32_t epochsMerged;
+	int32_t hasCorpus;
+	uint64_t corpusSeed;
+	TableRules rules;
+};
+
+constexpr char c_checkpointMagic[8] = "BJSCKPT";
+constexpr uint32_t c_checkpointVersion = 8;
+
+CheckpointHeader MakeCheckpointHeader(const SimulationOptions& options, int threadCount, int syncInterval, int epochsMerged, uint64_t corpusSeed)
+{
+	CheckpointHeader header = {};
+	memcpy(header.magic, c_checkpointMagic, sizeof(header.magic));
+	header.version = c_checkpointVersion;
+	header.tableSize = sizeof(ResultsCell) * c_maxPlayerHandIndex * c_maxDealerHandIndex;
+	header.shoeType = static_cast<int32_t>(options.shoeType);
+	header.threadCount = threadCount;
+	header.syncInterval = syncInterval;
+	header.exactDealer = options.exactDealer;
+	header.batchLanes = options.batchLanes;
+	header.countBuckets = GetCountBuckets(options);
+	header.dealMode = static_cast<int32_t>(options.dealMode);
+	header.epochsMerged = epochsMerged;
+	header.hasCorpus = !options.corpusPath.empty();
+	header.corpusSeed = corpusSeed;
+	header.rules = options.rules;
+	return header;
+}
+
+// Writes to a temporary file which then replaces the old checkpoint, so a run killed part way
+// through writing still leaves the previous checkpoint intact
+template <typename TFunc>
+bool WriteFileAtomically(const std::string& path, TFunc&& write)
+{
+	const std::string tempPath = path + ".tmp";
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		write(out);
+		out.flush();
+		if (!out)
+			return false;
+	}
+
+#ifdef _WIN32
+	return MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return std::rename(tempPath.c_str(), path.c_str()) == 0;
+#endif
+}
+
+// A shard is this header followed by the table's raw sums and counts, so shards from any number
+// of independent runs can be merged into one table as if they'd been a single run. Shards can
+// only be merged with shards from the same build, rules, shoe, dealer mode and --count.
+struct ShardHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t tableSize;
+	int32_t shoeType;
+	int32_t exactDealer;
+	int32_t countBuckets;
+	int32_t hasSeed;        // Merged shards have no seed of their own
+	uint64_t seed;
+	int64_t rounds;
+	TableRules rules;
+};
+
+constexpr char c_shardMagic[8] = "BJSSHRD";
+constexpr uint32_t c_shardVersion = 2;
+
+ShardHeader MakeShardHeader(const SimulationOptions& options, bool hasSeed, uint64_t seed, int64_t rounds)
+{
+	ShardHeader header = {};
+	memcpy(header.magic, c_shardMagic, sizeof(header.magic));
+	header.version = c_shardVersion;
+	header.tableSize = sizeof(ResultsCell) * c_maxPlayerHandIndex * c_maxDealerHandIndex;
+	header.shoeType = static_cast<int32_t>(options.shoeType);
+	header.exactDealer = options.exactDealer;
+	header.countBuckets = GetCountBuckets(options);
+	header.hasSeed = hasSeed;
+	header.seed = seed;
+	header.rounds = rounds;
+	header.rules = options.rules;
+	return header;
+}
+
+bool WriteShard(const std::string& path, const ShardHeader& header, const ResultsTable& resultsTable)
+{
+	return WriteFileAtomically(path, [&](std::ostream& out) {
+		WriteRaw(out, header);
+		resultsTable.Save(out);
+	});
+}
+
+// Picks starting deals for --stratify. Rounds cycle through every player hand and upcard two
+// cards and an upcard can make, so rare cells are sampled as often as common ones. Each deal is
+// drawn in proportion to how likely the shoe is to deal it, among those that make the cell.
+class StratifiedDeals
+{
+public:
+	StratifiedDeals();
+
+	struct Deal
+	{
+		int firstRank = 0;
+		int secondRank = 0;
+		bool isSameTen = false;    // When both cards are tens, whether they're the same face
+		int upcardRank = 0;
+
+		FaceMask FirstFaces() const { return GetRankFaces(firstRank); }
+		FaceMask SecondFaces(Card first) const;
+		FaceMask UpcardFaces() const { return GetRankFaces(upcardRank); }
+	};
+
+	static constexpr int c_strataCount = c_maxPlayerHandIndex * c_maxDealerHandIndex;
+
+	// A stratum is a cell, numbered playerHandIndex * c_maxDealerHandIndex + dealerHandIndex
+	// Picks a deal for the next cell that the remaining cards can make, advancing nextStratum past it.
+	// Returns false if the shoe can't make any of them.
+	bool Pick(int& nextStratum, const RankCounts& remainingRanks, RandomEngine& randomEngine, Deal& deal) const;
+
+	// Picks a deal for the given cell, returning false if the remaining cards can't make it
+	bool PickInStratum(int stratum, const RankCounts& remainingRanks, RandomEngine& randomEngine, Deal& deal) const;
+
+private:
+	static double GetWeight(const Deal& deal, const RankCounts& remainingRanks);
+
+	std::array<std::vector<Deal>, c_maxPlayerHandIndex> m_playerDeals;
+};
+
+StratifiedDeals::StratifiedDeals()
+{
+	constexpr int c_tenRank = c_rankCount - 1;
+	auto addDeal = [&](const Deal& deal, CardFace secondFace) {
+		const HandState first = g_handStates.Next(HandStateTable::c_emptyHand, static_cast<CardFace>(deal.firstRank));
+		const int playerHandIndex = g_handStates.Info(g_handStates.Next(first, secondFace)).playerHandIndex;
+		if (playerHandIndex >= 0)
+			m_playerDeals[playerHandIndex].push_back(deal);
+	};
+
+	for (int firstRank = 0; firstRank < c_rankCount; firstRank++)
+	{
+		for (int secondRank = 0; secondRank < c_rankCount; secondRank++)
+		{
+			Deal deal;
+			deal.firstRank = firstRank;
+			deal.secondRank = secondRank;
+			if (firstRank == c_tenRank && secondRank == c_tenRank)
+			{
+				// Two tens only make a pair when they're the same face, otherwise they're a hard 20
+				deal.isSameTen = true;
+				addDeal(deal, CardFace::Ten);
+				deal.isSameTen = false;
+				addDeal(deal, CardFace::Jack);
+			}
+			else
+			{
+				addDeal(deal, static_cast<CardFace>(secondRank));
+			}
+		}
+	}
+}
+
+FaceMask StratifiedDeals::Deal::SecondFaces(Card first) const
+{
+	constexpr int c_tenRank = c_rankCount - 1;
+	if (secondRank != c_tenRank || GetRank(first) != c_tenRank)
+		return GetRankFaces(secondRank);
+
+	const FaceMask firstFace = FaceBit(static_cast<int>(first.Face()));
+	return isSameTen ? firstFace : static_cast<FaceMask>(GetRankFaces(c_tenRank) & ~firstFace);
+}
+
+// Each ten valued face is taken to be a quarter of the tens left
+double StratifiedDeals::GetWeight(const Deal& deal, const RankCounts& remainingRanks)
+{
+	constexpr int c_tenRank = c_rankCount - 1;
+	const double first = remainingRanks[deal.firstRank];
+	double second = remainingRanks[deal.secondRank] - (deal.firstRank == deal.secondRank);
+	if (deal.firstRank == c_tenRank && deal.secondRank == c_tenRank)
+		second = deal.isSameTen ? first / 4 - 1 : first * 3 / 4;
+
+	const double upcard = remainingRanks[deal.upcardRank] - (deal.firstRank == deal.upcardRank) - (deal.secondRank == deal.upcardRank);
+	return std::max(first, 0.0) * std::max(second, 0.0) * std::max(upcard, 0.0);
+}
+
+bool StratifiedDeals::Pick(int& nextStratum, const RankCounts& remainingRanks, RandomEngine& randomEngine, Deal& deal) const
+{
+	for (int attempt = 0; attempt < c_strataCount; attempt++)
+	{
+		const int stratum = nextStratum;
+		nextStratum = (nextStratum + 1) % c_strataCount;
+
+		if (PickInStratum(stratum, remainingRanks, randomEngine, deal))
+			return true;
+	}
+
+	return false;
+}
+
+bool StratifiedDeals::PickInStratum(int stratum, const RankCounts& remainingRanks, RandomEngine& randomEngine, Deal& deal) const
+{
+	const int dealerHandIndex = stratum % c_maxDealerHandIndex;
+	const int upcardRank = dealerHandIndex == 9 ? 0 : dealerHandIndex + 1;
+
+	double totalWeight = 0;
+	std::array<double, 2 * c_rankCount> weights;
+	const std::vector<Deal>& deals = m_playerDeals[stratum / c_maxDealerHandIndex];
+	assert(deals.size() <= weights.size());
+	for (size_t i = 0; i < deals.size(); i++)
+	{
+		Deal candidate = deals[i];
+		candidate.upcardRank = upcardRank;
+		weights[i] = GetWeight(candidate, remainingRanks);
+		totalWeight += weights[i];
+	}
+
+	if (totalWeight <= 0)
+		return false;
+
+	double pick = randomEngine.NextDouble() * totalWeight;
+	size_t chosen = 0;
+	while (chosen + 1 < deals.size() && pick >= weights[chosen])
+		pick -= weights[chosen++];
+
+	deal = deals[chosen];
+	deal.upcardRank = upcardRank;
+	return true;
+}
+
+const StratifiedDeals g_stratifiedDeals;
+
+// Each worker owns its own shoe and plays against a private copy of the shared policy table.
+// Results are recorded both into that copy (so the worker keeps learning between merges) and
+// into a shard holding only the results gathered since the last merge. Decisions are read from
+// a PolicyTable kept in step with the copy.
+template <typename TRules, typename TShoe>
+class MarkovMonteWorker
+{
+public:
+	MarkovMonteWorker(const ResultsTable& sharedTable, const TableRules& rules, const RandomEngine& randomEngine, bool exactDealer, bool collectStats = false,
+		DealMode dealMode = DealMode::Natural, double confidenceZ = 0.0, double ciTolerance = 0.0, const CorpusStream& corpus = {})
+		: m_shoe(rules.decks, rules.penetration, randomEngine)
+		, m_player("Player 1", 0.0)
+		, m_maxHands(rules.maxHands)
+		, m_seatHands(rules.seats, PlayerHand(m_player, m_maxHands))
+		, m_tableBranches(4 * rules.seats, TableBranch{ PlayerHand(m_player, m_maxHands), 0, Action::Stand, 0.0 })
+		, m_policyTable(sharedTable)
+		, m_policy(sharedTable)
+		, m_shardTable(sharedTable.CountBuckets())
+		, m_exactDealer(exactDealer)
+		, m_dealerOutcomeCache(TRules::c_hitSoft17)
+		, m_collectStats(collectStats)
+		, m_dealMode(dealMode)
+		, m_confidenceZ(confidenceZ)
+		, m_ciTolerance(ciTolerance)
+		, m_dealEngine(RandomEngine(randomEngine)())
+	{
+		// Only shuffled shoes hold real cards to take from a corpus
+		if constexpr (std::is_same<TShoe, ShuffledShoe>::value)
+		{
+			if (corpus.corpus != nullptr)
+				m_shoe.UseCorpus(corpus);
+		}
+
+		if (m_dealMode == DealMode::Adaptive)
+			UpdateUnresolvedStrata(sharedTable);
+	}
+
+	void RunRounds(int rounds);
+	void SyncFrom(const ResultsTable& sharedTable);
+
+	const ResultsTable& Shard() const { return m_shardTable; }
+
+	// Only valid between epochs, straight after a SyncFrom. The policy table is the shared one
+	// at that point, so the shoe and the stratified deal state are all there is to save.
+	void Save(std::ostream& out) const;
+	bool Load(std::istream& in);
+
+	const RunStats& Stats() const { return m_stats; }
+
+private:
+	using StatsClock = std::chrono::steady_clock;
+
+	// One seat's branch of a table round, waiting on the dealer
+	struct TableBranch
+	{
+		PlayerHand hand;
+		int playerHandIndex;
+		Action action;
+		double result;
+	};
+
+	void RunRound();
+	void RunTableRound();
+	void DealStratified(PlayerHand& playerHand, DealerHand& dealerHand);
+	void UpdateUnresolvedStrata(const ResultsTable& sharedTable);
+	void RecordResult(int dealerHandIndex, int playerHandIndex, Action action, double result, int countBucket);
+
+	// Phases are timed back to back: each EndPhase adds the time since the last one to seconds.
+	// Both do nothing unless collecting stats, so the clock is never read otherwise.
+	void StartPhase();
+	void EndPhase(double& seconds);
+
+	TShoe m_shoe;
+	Player m_player;
+	int m_maxHands;
+
+	// For tables of more than one seat, reused every round
+	std::vector<PlayerHand> m_seatHands;
+	std::vector<TableBranch> m_tableBranches;
+	int m_tableBranchCount = 0;
+
+	ResultsTable m_policyTable;
+	PolicyTable m_policy;
+	ResultsTable m_shardTable;
+	bool m_exactDealer;
+	DealerOutcomeCache m_dealerOutcomeCache;
+
+	bool m_collectStats;
+	RunStats m_stats;
+	StatsClock::time_point m_phaseStart;
+
+	// For --stratify and --adaptive. The deal engine is seeded from the shoe's, so it's a separate
+	// stream.
+	DealMode m_dealMode;
+	double m_confidenceZ;
+	double m_ciTolerance;
+	RandomEngine m_dealEngine;
+	int m_nextStratum = 0;
+	std::vector<int> m_unresolvedStrata;
+};
+
+template <typename TRules, typename TShoe>
+void MarkovMonteWorker<TRules, TShoe>::RunRounds(int rounds)
+{
+	const bool isTable = m_seatHands.size() > 1;
+	for (int round = 0; round != rounds; round++)
+	{
+		if (isTable)
+			RunTableRound();
+		else
+			RunRound();
+	}
+}
+
+template <typename TRules, typename TShoe>
+void MarkovMonteWorker<TRules, TShoe>::Save(std::ostream& out) const
+{
+	m_shoe.Save(out);
+	WriteRaw(out, m_dealEngine);
+	WriteRaw(out, m_nextStratum);
+}
+
+template <typename TRules, typename TShoe>
+bool MarkovMonteWorker<TRules, TShoe>::Load(std::istream& in)
+{
+	return m_shoe.Load(in) && ReadRaw(in, m_dealEngine) && ReadRaw(in, m_nextStratum);
+}
+
+template <typename TRules, typename TShoe>
+void MarkovMonteWorker<TRules, TShoe>::SyncFrom(const ResultsTable& sharedTable)
+{
+	m_policyTable = sharedTable;
+	m_policy.Rebuild(sharedTable);
+	m_shardTable.Clear();
+
+	if (m_dealMode == DealMode::Adaptive)
+		UpdateUnresolvedStrata(sharedTable);
+}
+
+// Every worker works this out from the same merged table, so they all steer toward the same cells.
+// Dealing only the unresolved cells, equally, spends the same rounds in total as any split between
+// them would, and doesn't starve the cells that are nearly resolved.
+template <typename TRules, typename TShoe>
+void MarkovMonteWorker<TRules, TShoe>::UpdateUnresolvedStrata(const ResultsTable& sharedTable)
+{
+	const ResultsTable table = sharedTable.CombineCounts();
+
+	m_unresolvedStrata.clear();
+	for (int stratum = 0; stratum < StratifiedDeals::c_strataCount; stratum++)
+	{
+		const ResultsCell& cell = table.GetCell(stratum % c_maxDealerHandIndex, stratum / c_maxDealerHandIndex);
+
+		// Unlike the stopping check, cells nobody has visited yet need dealing
+		const bool isVisited = cell.GetResultData(Action::Stand).count > 0;
+		if (!isVisited || !IsCellResolved(cell, m_confidenceZ, m_ciTolerance))
+			m_unresolvedStrata.push_back(stratum);
+	}
+}
+
+template <typename TRules, typename TShoe>
+void MarkovMonteWorker<TRules, TShoe>::RecordResult(int dealerHandIndex, int playerHandIndex, Action action, double result, int countBucket)
+{
+	m_policyTable.RecordResult(dealerHandIndex, playerHandIndex, action, result, countBucket);
+	m_policy.Refresh(m_policyTable, dealerHandIndex, playerHandIndex, countBucket);
+	m_shardTable.RecordResult(dealerHandIndex, playerHandIndex, action, result, countBucket);
+	Trace(c_traceRounds, ThisThreadTrace().Write(TraceEvent::Result, { dealerHandIndex, playerHandIndex, static_cast<int>(action), countBucket }, static_cast<float>(result)));
+}
+
+template <typename TRules, typename TShoe>
+void MarkovMonteWorker<TRules, TShoe>::StartPhase()
+{
+	if (m_collectStats)
+		m_phaseStart = StatsClock::now();
+}
+
+template <typename TRules, typename TShoe>
+void MarkovMonteWorker<TRules, TShoe>::EndPhase(double& seconds)
+{
+	if (m_collectStats)
+	{
+		const StatsClock::time_point now = StatsClock::now();
+		seconds += std::chrono::duration<double>(now - m_phaseStart).count();
+		m_phaseStart = now;
+	}
+}
+
+// Deals the next stratum's cell. Results are recorded under whatever cell actually got dealt, in
+// case the shoe ran out of a card part way through.
+template <typename TRules, typename TShoe>
+void MarkovMonteWorker<TRules, TShoe>::DealStratified(PlayerHand& playerHand, DealerHand& dealerHand)
+{
+	const RankCounts remainingRanks = m_shoe.CurrentView().RemainingRanks();
+	StratifiedDeals::Deal deal;
+	bool isPicked = false;
+
+	// Adaptive runs pick a random unresolved stratum. Once they're all resolved, or if the shoe
+	// can't deal the one picked, strata are taken in turn as for --stratify.
+	if (m_dealMode == DealMode::Adaptive && !m_unresolvedStrata.empty())
+	{
+		const int stratum = m_unresolvedStrata[m_dealEngine.NextBelow(static_cast<uint32_t>(m_unresolvedStrata.size()))];
+		isPicked = g_stratifiedDeals.PickInStratum(stratum, remainingRanks, m_dealEngine, deal);
+	}
+
+	if (!isPicked && !g_stratifiedDeals.Pick(m_nextStratum, remainingRanks, m_dealEngine, deal))
+	{
+		playerHand.AddCard(m_shoe.DealCard());
+		dealerHand.AddCard(m_shoe.DealCard());
+		playerHand.AddCard(m_shoe.DealCard());
+		dealerHand.AddCard(m_shoe.DealCard());
+		return;
+	}
+
+	const Card first = m_shoe.DealMatching(deal.FirstFaces());
+	const Card second = m_shoe.DealMatching(deal.SecondFaces(first));
+	const Card upcard = m_shoe.DealMatching(deal.UpcardFaces());
+	const Card hole = m_shoe.DealCard();
+
+	// The dealer shows their second card
+	playerHand.AddCard(first);
+	playerHand.AddCard(second);
+	dealerHand.AddCard(hole);
+	dealerHand.AddCard(upcard);
+}
+
+template <typename TRules, typename TShoe>
+void MarkovMonteWorker<TRules, TShoe>::RunRound()
+{
+	TShoe& shoe = m_shoe;
+	Player& player = m_player;
+
+	player.ClearStats();
+
+	DealerHand dealerHand;
+	PlayerHand playerHand(player, m_maxHands);
+
+	const int offsetBeforeReload = shoe.CurrentView().Offset();
+	shoe.ReloadIfNecessary();
+	const int dealOffset = shoe.CurrentView().Offset();
+
+	// The count the player knows going into the round
+	const int countBucket = m_policyTable.CountBuckets() > 1 ? GetTrueCountBucket(shoe.CurrentView().RemainingRanks()) : 0;
+
+	if (m_collectStats)
+	{
+		m_stats.rounds++;
+		m_stats.reloads += dealOffset < offsetBeforeReload;
+	}
+
+	Trace(c_traceRounds, if (dealOffset < offsetBeforeReload) ThisThreadTrace().Write(TraceEvent::Reload, {}, static_cast<float>(offsetBeforeReload)));
+
+	if (m_dealMode != DealMode::Natural)
+	{
+		DealStratified(playerHand, dealerHand);
+	}
+	else
+	{
+		playerHand.AddCard(shoe.DealCard());
+		dealerHand.AddCard(shoe.DealCard());
+
+		playerHand.AddCard(shoe.DealCard());
+		dealerHand.AddCard(shoe.DealCard());
+	}
+
+	// Check blackjack push
+	// Check dealer blackjack lose
+	// Check player blackjack win
+	// Do decision tree
+
+	PlayerSubHand& hand = playerHand.PrimaryHand();
+	Trace(c_traceRounds, TraceDeal(hand, dealerHand, countBucket, 0));
+
+	if (m_collectStats && (hand.IsBlackjack() || dealerHand.IsBlackjack()))
+	{
+		m_stats.blackjackExits++;
+		m_stats.cardsDealt += 4;
+	}
+
+	// The round ends at a blackjack, so the stratified deal's cards go back now
+	if (m_dealMode != DealMode::Natural && (hand.IsBlackjack() || dealerHand.IsBlackjack()))
+		shoe.RestoreMatched();
+
+	if (hand.IsBlackjack() && dealerHand.IsBlackjack())
+	{
+		// push
+		return;
+	}
+	else if (dealerHand.IsBlackjack())
+	{
+		// TODO: accumulate money
+		return;
+	}
+	else if (hand.IsBlackjack())
+	{
+		// TODO: accumulate money
+		return;
+	}
+
+	int dealerHandIndex = MapDealerHandToActionIndex(dealerHand.Showing());
+	int playerHandIndex = MapPlayerHandToActionIndex(hand);
+
+	// Every action is tried from the same deal. Rather than cloning the hands and shoe for each one,
+	// the branch state is rolled back to the dealt position before trying the next action. None of
+	// it allocates, so this is just a few small copies.
+	PlayerHand branchHand(player, m_maxHands);
+	DealerHand branchDealerHand;
+	const typename TShoe::View dealtShoe = shoe.CurrentView();
+	typename TShoe::View branchShoe = dealtShoe;
+	typename TShoe::View longestBranchShoe = dealtShoe;
+
+	constexpr std::array<Action, 4> allActions { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+	for (Action action : allActions)
+	{
+		if (!CanDoAction<TRules>(playerHand, hand, action))
+			continue;
+
+		if (action == Action::Split)
+			assert(playerHandIndex > 20);
+
+		StartPhase();
+
+		branchHand = playerHand;
+		branchDealerHand = dealerHand;
+		branchShoe = dealtShoe;
+
+		DoAction(branchHand, branchHand.PrimaryHand(), action, branchShoe);
+
+		CompletePlayerOptimally<TRules>(branchDealerHand, branchHand, m_policy, countBucket, branchShoe, action);
+		EndPhase(m_stats.playerSeconds);
+
+		double result;
+		if (m_exactDealer)
+			result = ScoreAgainstDealerOutcomes<TRules>(branchDealerHand, branchHand, branchShoe, m_dealerOutcomeCache);
+		else
+			result = CompleteDealer<TRules>(branchDealerHand, branchHand, branchShoe);
+		EndPhase(m_stats.dealerSeconds);
+
+		RecordResult(dealerHandIndex, playerHandIndex, action, result, countBucket);
+		EndPhase(m_stats.tableSeconds);
+
+		if (m_collectStats)
+		{
+			m_stats.branches[static_cast<int>(action)]++;
+			m_stats.splits += branchHand.SubHandCount() - 1;
+		}
+
+		// Every branch deals the same sequence of cards, so the one that dealt the most has seen them all
+		if (branchShoe.Offset() > longestBranchShoe.Offset())
+			longestBranchShoe = branchShoe;
+	}
+
+	shoe.AdvanceTo(longestBranchShoe);
+	if (m_dealMode != DealMode::Natural)
+		shoe.RestoreMatched();
+
+	if (m_collectStats)
+		m_stats.cardsDealt += longestBranchShoe.Offset() - dealOffset;
+
+	player.SignalNewHand();
+}
+
+// Plays a round with every seat at the table. The seats are dealt, and play, in table order from
+// the shared shoe. Each one tries every action from where the seats before it left the shoe, then
+// the table carries on from wherever its best action left it, as that's what it actually plays.
+// The dealer then finishes once, from past every card any branch dealt so none of them turn up in
+// the dealer's hand, and every seat's branches are scored against that one hand.
+template <typename TRules, typename TShoe>
+void MarkovMonteWorker<TRules, TShoe>::RunTableRound()
+{
+	TShoe& shoe = m_shoe;
+	const int seats = static_cast<int>(m_seatHands.size());
+
+	const int offsetBeforeReload = shoe.CurrentView().Offset();
+	shoe.ReloadIfNecessary();
+	const int dealOffset = shoe.CurrentView().Offset();
+
+	// The count every seat knows going into the round
+	const int countBucket = m_policyTable.CountBuckets() > 1 ? GetTrueCountBucket(shoe.CurrentView().RemainingRanks()) : 0;
+
+	if (m_collectStats)
+	{
+		m_stats.rounds++;
+		m_stats.reloads += dealOffset < offsetBeforeReload;
+	}
+
+	Trace(c_traceRounds, if (dealOffset < offsetBeforeReload) ThisThreadTrace().Write(TraceEvent::Reload, {}, static_cast<float>(offsetBeforeReload)));
+
+	// A card to each seat then the dealer's hole card, and again for the dealer's upcard
+	DealerHand dealerHand;
+	for (PlayerHand& seatHand : m_seatHands)
+		seatHand = PlayerHand(m_player, m_maxHands);
+
+	for (int card = 0; card < 2; card++)
+	{
+		for (PlayerHand& seatHand : m_seatHands)
+			seatHand.AddCard(shoe.DealCard());
+		dealerHand.AddCard(shoe.DealCard());
+	}
+
+	Trace(c_traceRounds, for (int seat = 0; seat < seats; seat++) TraceDeal(m_seatHands[seat].PrimaryHand(), dealerHand, countBucket, seat));
+
+	// Seats with blackjack are paid straight away and sit the round out
+	bool isAnySeatPlaying = false;
+	for (PlayerHand& seatHand : m_seatHands)
+		isAnySeatPlaying = isAnySeatPlaying || !seatHand.PrimaryHand().IsBlackjack();
+
+	if (dealerHand.IsBlackjack() || !isAnySeatPlaying)
+	{
+		if (m_collectStats)
+		{
+			m_stats.blackjackExits++;
+			m_stats.cardsDealt += 2 * (seats + 1);
+		}
+		return;
+	}
+
+	const int dealerHandIndex = MapDealerHandToActionIndex(dealerHand.Showing());
+	typename TShoe::View seatShoe = shoe.CurrentView();
+	typename TShoe::View branchShoe = seatShoe;
+	typename TShoe::View longestBranchShoe = seatShoe;
+	m_tableBranchCount = 0;
+
+	constexpr std::array<Action, 4> allActions { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+	for (PlayerHand& seatHand : m_seatHands)
+	{
+		PlayerSubHand& hand = seatHand.PrimaryHand();
+		if (hand.IsBlackjack())
+			continue;
+
+		const int playerHandIndex = MapPlayerHandToActionIndex(hand);
+		const Action playedAction = m_policy.GetOptimalAction(dealerHandIndex, playerHandIndex, seatHand.ActionMask<TRules>(hand), countBucket);
+		typename TShoe::View nextSeatShoe = seatShoe;
+
+		for (Action action : allActions)
+		{
+			if (!CanDoAction<TRules>(seatHand, hand, action))
+				continue;
+
+			StartPhase();
+
+			TableBranch& branch = m_tableBranches[m_tableBranchCount++];
+			branch.hand = seatHand;
+			branch.playerHandIndex = playerHandIndex;
+			branch.action = action;
+			branchShoe = seatShoe;
+
+			DoAction(branch.hand, branch.hand.PrimaryHand(), action, branchShoe);
+			CompletePlayerOptimally<TRules>(dealerHand, branch.hand, m_policy, countBucket, branchShoe, action);
+			EndPhase(m_stats.playerSeconds);
+
+			if (action == playedAction)
+				nextSeatShoe = branchShoe;
+
+			// Every branch of every seat deals from the same sequence of cards
+			if (branchShoe.Offset() > longestBranchShoe.Offset())
+				longestBranchShoe = branchShoe;
+
+			if (m_collectStats)
+			{
+				m_stats.branches[static_cast<int>(action)]++;
+				m_stats.splits += branch.hand.SubHandCount() - 1;
+			}
+		}
+
+		seatShoe = nextSeatShoe;
+	}
+
+	StartPhase();
+	if (m_exactDealer)
+	{
+		const DealerOutcomes& dealerOutcomes = GetDealerOutcomes(dealerHand, longestBranchShoe, m_dealerOutcomeCache);
+		for (int i = 0; i < m_tableBranchCount; i++)
+			m_tableBranches[i].result = ScoreAgainstDealerOutcomes<TRules>(m_tableBranches[i].hand, dealerOutcomes);
+	}
+	else
+	{
+		DrawDealerHand<TRules>(dealerHand, longestBranchShoe);
+		for (int i = 0; i < m_tableBranchCount; i++)
+			m_tableBranches[i].result = ScoreAgainstDealerHand<TRules>(m_tableBranches[i].hand, dealerHand);
+	}
+	EndPhase(m_stats.dealerSeconds);
+
+	for (int i = 0; i < m_tableBranchCount; i++)
+	{
+		const TableBranch& branch = m_tableBranches[i];
+		RecordResult(dealerHandIndex, branch.playerHandIndex, branch.action, branch.result, countBucket);
+	}
+	EndPhase(m_stats.tableSeconds);
+
+	shoe.AdvanceTo(longestBranchShoe);
+
+	if (m_collectStats)
+		m_stats.cardsDealt += longestBranchShoe.Offset() - dealOffset;
+}
+
+// Plays many independent rounds at once, one per lane, each lane dealing from its own shuffled
+// shoe. The player's side of a round branches too much to vectorize, so each lane plays out its
+// hands on its own as usual, but stops short of the dealer. Every branch then leaves behind the
+// same short job, completing the dealer's hand and scoring the player's against it, which is
+// stored structure of arrays and run across the whole batch at once, eight lanes at a time when
+// built with AVX2 and one at a time otherwise.
+//
+// Results are recorded once the whole batch is scored, so a lane plays against the policy as it
+// stood at the start of the batch rather than seeing the results of the lanes before it.
+template <typename TRules>
+class BatchMarkovMonteWorker
+{
+public:
+	BatchMarkovMonteWorker(const ResultsTable& sharedTable, const TableRules& rules, const RandomEngine& randomEngine, int laneCount, bool collectStats = false,
+		const CorpusStream& corpus = {});
+
+	void RunRounds(int rounds);
+	void SyncFrom(const ResultsTable& sharedTable);
+
+	const ResultsTable& Shard() const { return m_shardTable; }
+
+	// Only valid between epochs, like MarkovMonteWorker's
+	void Save(std::ostream& out) const;
+	bool Load(std::istream& in);
+
+	const RunStats& Stats() const { return m_stats; }
+
+private:
+	using StatsClock = std::chrono::steady_clock;
+
+	// The table each branch's result is recorded in
+	struct BranchCell
+	{
+		int lane;
+		uint8_t dealerHandIndex;
+		uint8_t playerHandIndex;
+		Action action;
+		uint8_t countBucket;
+	};
+
+	void RunBatch(int laneCount);
+	void PlayLane(int lane);
+	void CompleteDealers();
+	void ScoreHands();
+	void RecordResults();
+
+	void CopyLaneFaces(int lane);
+
+	void StartPhase();
+	void EndPhase(double& seconds);
+
+	Player m_player;
+	int m_maxHands;
+	ResultsTable m_policyTable;
+	PolicyTable m_policy;
+	ResultsTable m_shardTable;
+
+	std::vector<DeckShoe> m_laneShoes;
+	std::vector<int> m_laneOffsets;     // Where each lane's next round deals from
+	int m_laneStride;                   // Cards per shoe
+	int m_reloadOffset;
+
+	// Every lane's shoe as faces, lane after lane. Padded so a four byte gather of the last card
+	// stays in bounds.
+	std::vector<uint8_t> m_faces;
+
+	// g_handStates flattened into arrays the kernels can gather from
+	std::vector<int32_t> m_transitions;     // [state * 16 + face]
+	std::vector<int32_t> m_dealerMustHit;   // -1 if the dealer draws to the state, else 0
+	std::vector<int32_t> m_stateValues;
+	std::vector<int32_t> m_stateBlackjacks; // -1 for a blackjack, else 0
+
+	// One per branch, in the order they were played
+	std::vector<BranchCell> m_branchCells;
+	std::vector<int32_t> m_dealerStates;        // Completed in place
+	std::vector<int32_t> m_dealerPositions;     // Index into m_faces of the dealer's next card
+	std::vector<int32_t> m_branchResults;       // In units of 1 / c_blackjackPayoutDenominator
+
+	// One per player sub hand of every branch
+	std::vector<int32_t> m_handBranches;
+	std::vector<int32_t> m_handValues;
+	std::vector<int32_t> m_handBlackjacks;      // -1 for a blackjack, else 0
+	std::vector<int32_t> m_handBets;
+	std::vector<int32_t> m_handResults;         // Bet times outcome, in the same units as m_branchResults
+
+	bool m_collectStats;
+	RunStats m_stats;
+	StatsClock::time_point m_phaseStart;
+};
+
+template <typename TRules>
+BatchMarkovMonteWorker<TRules>::BatchMarkovMonteWorker(const ResultsTable& sharedTable, const TableRules& rules, const RandomEngine& randomEngine, int laneCount, bool collectStats,
+	const CorpusStream& corpus)
+	: m_player("Player 1", 0.0)
+	, m_maxHands(rules.maxHands)
+	, m_policyTable(sharedTable)
+	, m_policy(sharedTable)
+	, m_shardTable(sharedTable.CountBuckets())
+	, m_laneOffsets(laneCount, 0)
+	, m_laneStride(52 * rules.decks)
+	, m_reloadOffset(ReloadOffset(rules.penetration, 52 * rules.decks))
+	, m_collectStats(collectStats)
+{
+	// Each lane's shoe is seeded from this worker's stream, which keeps the lanes clear of the
+	// other workers' streams. With a corpus, the lanes split the worker's stream of shoes between
+	// them the same way.
+	RandomEngine seedEngine = randomEngine;
+	m_laneShoes.reserve(laneCount);
+	m_faces.resize(static_cast<size_t>(laneCount) * m_laneStride + 4);
+	for (int lane = 0; lane < laneCount; lane++)
+	{
+		const CorpusStream laneCorpus = { corpus.corpus, corpus.nextShoe * laneCount + lane, corpus.stride * laneCount };
+		m_laneShoes.emplace_back(rules.decks, RandomEngine(seedEngine()), laneCorpus);
+		CopyLaneFaces(lane);
+	}
+
+	const size_t stateCount = g_handStates.StateCount();
+	m_transitions.resize(stateCount * 16);
+	for (size_t state = 0; state < stateCount; state++)
+	{
+		const HandStateInfo& info = g_handStates.Info(static_cast<HandState>(state));
+		for (int face = 0; face < 13; face++)
+			m_transitions[state * 16 + face] = g_handStates.Next(static_cast<HandState>(state), static_cast<CardFace>(face));
+
+		m_dealerMustHit.push_back(TRules::DealerMustHit(info) ? -1 : 0);
+		m_stateValues.push_back(info.value);
+		m_stateBlackjacks.push_back(info.isBlackjack ? -1 : 0);
+	}
+}
+
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::RunRounds(int rounds)
+{
+	const int laneCount = static_cast<int>(m_laneShoes.size());
+	for (int remaining = rounds; remaining > 0; remaining -= laneCount)
+		RunBatch(std::min(remaining, laneCount));
+}
+
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::SyncFrom(const ResultsTable& sharedTable)
+{
+	m_policyTable = sharedTable;
+	m_policy.Rebuild(sharedTable);
+	m_shardTable.Clear();
+}
+
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::Save(std::ostream& out) const
+{
+	for (size_t lane = 0; lane < m_laneShoes.size(); lane++)
+	{
+		m_laneShoes[lane].Save(out);
+		WriteRaw(out, m_laneOffsets[lane]);
+	}
+}
+
+template <typename TRules>
+bool BatchMarkovMonteWorker<TRules>::Load(std::istream& in)
+{
+	for (size_t lane = 0; lane < m_laneShoes.size(); lane++)
+	{
+		if (!m_laneShoes[lane].Load(in) || !ReadRaw(in, m_laneOffsets[lane]))
+			return false;
+
+		CopyLaneFaces(static_cast<int>(lane));
+	}
+	return true;
+}
+
+// Copies the lane's shoe into m_faces, whenever the shoe has been shuffled or loaded
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::CopyLaneFaces(int lane)
+{
+	const DeckShoe& shoe = m_laneShoes[lane];
+	uint8_t* faces = &m_faces[static_cast<size_t>(lane) * m_laneStride];
+	for (int i = 0; i < m_laneStride; i++)
+		faces[i] = static_cast<uint8_t>(shoe.GetCard(i).Face());
+}
+
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::StartPhase()
+{
+	if (m_collectStats)
+		m_phaseStart = StatsClock::now();
+}
+
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::EndPhase(double& seconds)
+{
+	if (m_collectStats)
+	{
+		const StatsClock::time_point now = StatsClock::now();
+		seconds += std::chrono::duration<double>(now - m_phaseStart).count();
+		m_phaseStart = now;
+	}
+}
+
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::RunBatch(int laneCount)
+{
+	m_branchCells.clear();
+	m_dealerStates.clear();
+	m_dealerPositions.clear();
+	m_handBranches.clear();
+	m_handValues.clear();
+	m_handBlackjacks.clear();
+	m_handBets.clear();
+
+	StartPhase();
+	for (int lane = 0; lane < laneCount; lane++)
+		PlayLane(lane);
+	EndPhase(m_stats.playerSeconds);
+
+	CompleteDealers();
+	ScoreHands();
+	EndPhase(m_stats.dealerSeconds);
+
+	RecordResults();
+	EndPhase(m_stats.tableSeconds);
+}
+
+// Deals the lane's round and plays out every action the player could take, leaving a job behind
+// for each one. Rounds over at the deal leave nothing behind.
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::PlayLane(int lane)
+{
+	if (m_laneOffsets[lane] > m_reloadOffset)
+	{
+		Trace(c_traceRounds, ThisThreadTrace().Write(TraceEvent::Reload, {}, static_cast<float>(m_laneOffsets[lane])));
+		m_laneShoes[lane].Reload();
+		CopyLaneFaces(lane);
+		m_laneOffsets[lane] = 0;
+		if (m_collectStats)
+			m_stats.reloads++;
+	}
+
+	DeckShoeView shoe(m_laneShoes[lane]);
+	shoe.SetOffset(m_laneOffsets[lane]);
+
+	const int countBucket = m_policyTable.CountBuckets() > 1 ? GetTrueCountBucket(shoe.RemainingRanks()) : 0;
+
+	DealerHand dealerHand;
+	PlayerHand playerHand(m_player, m_maxHands);
+
+	playerHand.AddCard(shoe.DealCard());
+	dealerHand.AddCard(shoe.DealCard());
+
+	playerHand.AddCard(shoe.DealCard());
+	dealerHand.AddCard(shoe.DealCard());
+
+	// The lane's offset only moves past the dealer's cards once the jobs have been run
+	m_laneOffsets[lane] = shoe.Offset();
+	Trace(c_traceRounds, TraceDeal(playerHand.PrimaryHand(), dealerHand, countBucket, 0));
+
+	if (m_collectStats)
+	{
+		m_stats.rounds++;
+		m_stats.cardsDealt += 4;
+	}
+
+	PlayerSubHand& hand = playerHand.PrimaryHand();
+	if (hand.IsBlackjack() || dealerHand.IsBlackjack())
+	{
+		if (m_collectStats)
+			m_stats.blackjackExits++;
+		return;
+	}
+
+	const int dealerHandIndex = MapDealerHandToActionIndex(dealerHand.Showing());
+	const int playerHandIndex = MapPlayerHandToActionIndex(hand);
+	const int laneBase = lane * m_laneStride;
+
+	PlayerHand branchHand(m_player, m_maxHands);
+	DeckShoeView branchShoe = shoe;
+
+	constexpr std::array<Action, 4> allActions { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+	for (Action action : allActions)
+	{
+		if (!CanDoAction<TRules>(playerHand, hand, action))
+			continue;
+
+		branchHand = playerHand;
+		branchShoe = shoe;
+
+		DoAction(branchHand, branchHand.PrimaryHand(), action, branchShoe);
+		CompletePlayerOptimally<TRules>(dealerHand, branchHand, m_policy, countBucket, branchShoe, action);
+
+		const int branch = static_cast<int>(m_branchCells.size());
+		m_branchCells.push_back(BranchCell{ lane, static_cast<uint8_t>(dealerHandIndex), static_cast<uint8_t>(playerHandIndex), action, static_cast<uint8_t>(countBucket) });
+		m_dealerStates.push_back(dealerHand.State());
+		m_dealerPositions.push_back(laneBase + branchShoe.Offset());
+
+		for (int i = 0; i < branchHand.SubHandCount(); i++)
+		{
+			const PlayerSubHand& subHand = branchHand.SubHand(i);
+			m_handBranches.push_back(branch);
+			m_handValues.push_back(subHand.Value());
+			m_handBlackjacks.push_back(subHand.IsBlackjack() ? -1 : 0);
+			m_handBets.push_back(static_cast<int32_t>(subHand.Bet()));
+		}
+
+		if (m_collectStats)
+		{
+			m_stats.branches[static_cast<int>(action)]++;
+			m_stats.splits += branchHand.SubHandCount() - 1;
+		}
+	}
+}
+
+// Draws to every branch's dealer hand until it stands
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::CompleteDealers()
+{
+	const int count = static_cast<int>(m_dealerStates.size());
+	int32_t* states = m_dealerStates.data();
+	int32_t* positions = m_dealerPositions.data();
+	int i = 0;
+
+#if defined(__AVX2__)
+	// Lanes that are done drawing are masked out of the gathers and left as they are, until every
+	// lane of the eight is done
+	const int* faces = reinterpret_cast<const int*>(m_faces.data());
+	const __m256i faceMask = _mm256_set1_epi32(0xFF);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i state = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(states + i));
+		__m256i position = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(positions + i));
+
+		for (;;)
+		{
+			const __m256i mustHit = _mm256_i32gather_epi32(m_dealerMustHit.data(), state, 4);
+			if (_mm256_testz_si256(mustHit, mustHit))
+				break;
+
+			const __m256i face = _mm256_and_si256(_mm256_mask_i32gather_epi32(_mm256_setzero_si256(), faces, position, mustHit, 1), faceMask);
+			const __m256i transition = _mm256_add_epi32(_mm256_slli_epi32(state, 4), face);
+			state = _mm256_mask_i32gather_epi32(state, m_transitions.data(), transition, mustHit, 4);
+			position = _mm256_sub_epi32(position, mustHit);
+		}
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(states + i), state);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(positions + i), position);
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		int32_t state = states[i];
+		int32_t position = positions[i];
+		while (m_dealerMustHit[state])
+			state = m_transitions[state * 16 + m_faces[position++]];
+
+		states[i] = state;
+		positions[i] = position;
+	}
+}
+
+// Scores every sub hand against its branch's dealer hand. Outcomes are kept in whole units of
+// 1 / c_blackjackPayoutDenominator so every payout is an integer.
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::ScoreHands()
+{
+	constexpr int32_t c_win = TRules::c_blackjackPayoutDenominator;
+	constexpr int32_t c_blackjack = TRules::c_blackjackPayoutNumerator;
+
+	const int count = static_cast<int>(m_handValues.size());
+	m_handResults.resize(count);
+	int i = 0;
+
+#if defined(__AVX2__)
+	const __m256i win = _mm256_set1_epi32(c_win);
+	const __m256i loss = _mm256_set1_epi32(-c_win);
+	const __m256i push = _mm256_setzero_si256();
+	const __m256i blackjack = _mm256_set1_epi32(c_blackjack);
+	const __m256i twentyOne = _mm256_set1_epi32(21);
+	for (; i + 8 <= count; i += 8)
+	{
+		const __m256i branch = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_handBranches.data() + i));
+		const __m256i dealerState = _mm256_i32gather_epi32(m_dealerStates.data(), branch, 4);
+		const __m256i dealerValue = _mm256_i32gather_epi32(m_stateValues.data(), dealerState, 4);
+		const __m256i dealerBlackjack = _mm256_i32gather_epi32(m_stateBlackjacks.data(), dealerState, 4);
+		const __m256i playerValue = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_handValues.data() + i));
+		const __m256i playerBlackjack = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_handBlackjacks.data() + i));
+		const __m256i bet = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m_handBets.data() + i));
+
+		// GetHandOutcome's checks from the last to the first, each overriding the ones before
+		__m256i outcome = loss;
+		outcome = _mm256_blendv_epi8(outcome, push, _mm256_cmpeq_epi32(playerValue, dealerValue));
+		outcome = _mm256_blendv_epi8(outcome, win, _mm256_or_si256(_mm256_cmpgt_epi32(dealerValue, twentyOne), _mm256_cmpgt_epi32(playerValue, dealerValue)));
+		outcome = _mm256_blendv_epi8(outcome, blackjack, playerBlackjack);
+		outcome = _mm256_blendv_epi8(outcome, loss, dealerBlackjack);
+		outcome = _mm256_blendv_epi8(outcome, push, _mm256_and_si256(playerBlackjack, dealerBlackjack));
+		outcome = _mm256_blendv_epi8(outcome, loss, _mm256_cmpgt_epi32(playerValue, twentyOne));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(m_handResults.data() + i), _mm256_mullo_epi32(outcome, bet));
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		const int32_t dealerState = m_dealerStates[m_handBranches[i]];
+		const int32_t dealerValue = m_stateValues[dealerState];
+		const bool dealerBlackjack = m_stateBlackjacks[dealerState] != 0;
+		const int32_t playerValue = m_handValues[i];
+		const bool playerBlackjack = m_handBlackjacks[i] != 0;
+
+		int32_t outcome;
+		if (playerValue > 21)
+			outcome = -c_win;
+		else if (playerBlackjack && dealerBlackjack)
+			outcome = 0;
+		else if (dealerBlackjack)
+			outcome = -c_win;
+		else if (playerBlackjack)
+			outcome = c_blackjack;
+		else if (dealerValue > 21 || playerValue > dealerValue)
+			outcome = c_win;
+		else if (playerValue == dealerValue)
+			outcome = 0;
+		else
+			outcome = -c_win;
+
+		m_handResults[i] = outcome * m_handBets[i];
+	}
+}
+
+// Sums each branch's hands, records the branches in the order they were played, and moves every
+// lane past the cards its longest branch dealt
+template <typename TRules>
+void BatchMarkovMonteWorker<TRules>::RecordResults()
+{
+	m_branchResults.assign(m_branchCells.size(), 0);
+	for (size_t i = 0; i < m_handResults.size(); i++)
+		m_branchResults[m_handBranches[i]] += m_handResults[i];
+
+	for (size_t branch = 0; branch < m_branchCells.size(); branch++)
+	{
+		const BranchCell& cell = m_branchCells[branch];
+		const double result = static_cast<double>(m_branchResults[branch]) / TRules::c_blackjackPayoutDenominator;
+
+		m_policyTable.RecordResult(cell.dealerHandIndex, cell.playerHandIndex, cell.action, result, cell.countBucket);
+		m_policy.Refresh(m_policyTable, cell.dealerHandIndex, cell.playerHandIndex, cell.countBucket);
+		m_shardTable.RecordResult(cell.dealerHandIndex, cell.playerHandIndex, cell.action, result, cell.countBucket);
+		Trace(c_traceRounds, ThisThreadTrace().Write(TraceEvent::Result, { cell.dealerHandIndex, cell.playerHandIndex, static_cast<int>(cell.action), cell.countBucket }, static_cast<float>(result)));
+
+		// Branches of a round deal the same sequence of cards, so the one that dealt the most has seen them all
+		const int offset = m_dealerPositions[branch] - cell.lane * m_laneStride;
+		if (m_collectStats && offset > m_laneOffsets[cell.lane])
+			m_stats.cardsDealt += offset - m_laneOffsets[cell.lane];
+		m_laneOffsets[cell.lane] = std::max(m_laneOffsets[cell.lane], offset);
+	}
+}
+
+// Runs the simulation with workers made by makeWorker(resultsTable, randomEngine, corpusStream),
+// each given its own stream of the generator and of the corpus's shoes
+template <typename TWorker, typename TMakeWorker>
+bool RunMarkovMonteWorkers(const SimulationOptions& options, ResultsTable& resultsTable, TMakeWorker&& makeWorker)
+{
+	int threadCount = options.threads;
+	if (threadCount <= 0)
+		threadCount = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+	const int syncInterval = std::max(1, options.syncInterval);
+
+	// Split the rounds across the workers, and make every worker take part in the same number
+	// of merges so they can all meet at the barrier.
+	std::vector<int> workerRounds(threadCount, options.iterations / threadCount);
+	for (int i = 0; i < options.iterations % threadCount; i++)
+		workerRounds[i]++;
+
+	const int epochCount = (workerRounds[0] + syncInterval - 1) / syncInterval;
+
+	// Every worker gets its own stream of the seeded generator, so a given seed and thread count
+	// always reproduces the same table
+	const uint64_t seed = ChooseSeed(options);
+	RandomEngine randomEngine(seed);
+
+	ShoeCorpus corpus;
+	const bool hasCorpus = !options.corpusPath.empty();
+	if (hasCorpus && !corpus.Open(options.corpusPath))
+	{
+		std::cerr << options.corpusPath << " isn't a shoe corpus from this build\n";
+		return false;
+	}
+
+	if (hasCorpus && corpus.Decks() != options.rules.decks)
+	{
+		std::cerr << options.corpusPath << " holds " << corpus.Decks() << " deck shoes, but --decks is " << options.rules.decks << "\n";
+		return false;
+	}
+
+	// Worker i deals shoes i, i + threadCount, i + 2 * threadCount... so a corpus with the same
+	// thread count always deals each worker the same shoes
+	std::vector<std::unique_ptr<TWorker>> workers;
+	for (int i = 0; i < threadCount; i++)
+	{
+		const CorpusStream corpusStream = { hasCorpus ? &corpus : nullptr, static_cast<uint64_t>(i), static_cast<uint64_t>(threadCount) };
+		workers.push_back(makeWorker(resultsTable, randomEngine, corpusStream));
+		randomEngine.Jump();
+	}
+
+	const double confidenceZ = options.confidence > 0 ? GetConfidenceZ(options.confidence) : 0.0;
+	int epochsMerged = 0;
+	bool isResolved = false;
+
+	auto roundsPlayed = [&]() {
+		int rounds = 0;
+		for (int workerRound : workerRounds)
+			rounds += std::min(workerRound, epochsMerged * syncInterval);
+		return rounds;
+	};
+
+	std::ifstream checkpointIn;
+	if (options.resume)
+		checkpointIn.open(options.checkpointPath, std::ios::binary);
+
+	if (options.resume && !checkpointIn)
+	{
+		std::cerr << "No checkpoint at " << options.checkpointPath << ", starting from scratch\n";
+	}
+	else if (options.resume)
+	{
+		const CheckpointHeader expected = MakeCheckpointHeader(options, threadCount, syncInterval, 0, corpus.Seed());
+		CheckpointHeader header;
+		if (!ReadRaw(checkpointIn, header) || memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0
+			|| header.version != expected.version || header.tableSize != expected.tableSize)
+		{
+			std::cerr << options.checkpointPath << " isn't a checkpoint from this build\n";
+			return false;
+		}
+
+		if (header.shoeType != expected.shoeType || header.threadCount != expected.threadCount
+			|| header.syncInterval != expected.syncInterval || header.exactDealer != expected.exactDealer || header.batchLanes != expected.batchLanes || header.countBuckets != expected.countBuckets
+			|| header.dealMode != expected.dealMode || header.hasCorpus != expected.hasCorpus || header.corpusSeed != expected.corpusSeed || !(header.rules == expected.rules))
+		{
+			std::cerr << options.checkpointPath << " was written with a different --shoe, --dealer, --threads, --sync-interval, --batch, --count, --stratify, --adaptive, --corpus or table rules\n";
+			return false;
+		}
+
+		bool isLoaded = resultsTable.Load(checkpointIn);
+		for (auto& worker : workers)
+			isLoaded = isLoaded && worker->Load(checkpointIn);
+
+		if (!isLoaded)
+		{
+			std::cerr << options.checkpointPath << " is truncated\n";
+			return false;
+		}
+
+		for (auto& worker : workers)
+			worker->SyncFrom(resultsTable);
+
+		epochsMerged = header.epochsMerged;
+		isResolved = confidenceZ > 0 && CountUnresolvedCells(resultsTable, confidenceZ, options.ciTolerance) == 0;
+		std::cerr << "Resuming after " << roundsPlayed() << " rounds\n";
+	}
+
+	const int firstEpoch = epochsMerged;
+
+	// With no interval given, checkpoint once a minute
+	const double checkpointSeconds = (options.checkpointRounds <= 0 && options.checkpointSeconds <= 0) ? 60.0 : options.checkpointSeconds;
+	auto lastCheckpointTime = std::chrono::steady_clock::now();
+	int lastCheckpointRounds = roundsPlayed();
+
+	auto writeCheckpoint = [&]() {
+		const bool isWritten = WriteFileAtomically(options.checkpointPath, [&](std::ostream& out) {
+			WriteRaw(out, MakeCheckpointHeader(options, threadCount, syncInterval, epochsMerged, corpus.Seed()));
+			resultsTable.Save(out);
+			for (const auto& worker : workers)
+				worker->Save(out);
+		});
+
+		if (!isWritten)
+			std::cerr << "Failed to write checkpoint " << options.checkpointPath << "\n";
+
+		lastCheckpointTime = std::chrono::steady_clock::now();
+		lastCheckpointRounds = roundsPlayed();
+	};
+
+	std::unique_ptr<SnapshotWriter> snapshotWriter;
+	if (!options.snapshotPath.empty())
+	{
+		snapshotWriter = std::make_unique<SnapshotWriter>(options.snapshotPath, options.snapshotFormat, options.resume);
+		if (!snapshotWriter->IsOpen())
+		{
+			std::cerr << "Can't open " << options.snapshotPath << "\n";
+			return false;
+		}
+	}
+
+	int lastSnapshotRounds = roundsPlayed();
+
+	const auto startTime = std::chrono::steady_clock::now();
+	auto lastStatsTime = startTime;
+	auto printStats = [&]() {
+		RunStats stats;
+		for (const auto& worker : workers)
+			stats.Merge(worker->Stats());
+
+		lastStatsTime = std::chrono::steady_clock::now();
+		PrintRunStats(stats, std::chrono::duration<double>(lastStatsTime - startTime).count());
+	};
+
+	SyncBarrier barrier(threadCount);
+	auto mergeShards = [&]() {
+		// Merge in worker order so the shared table doesn't depend on thread scheduling
+		for (const auto& worker : workers)
+			resultsTable.Merge(worker->Shard());
+
+		epochsMerged++;
+
+		if (confidenceZ > 0 && CountUnresolvedCells(resultsTable, confidenceZ, options.ciTolerance) == 0)
+		{
+			std::cerr << "Every cell resolved at " << options.confidence << " confidence after " << roundsPlayed() << " rounds\n";
+			isResolved = true;
+		}
+
+		if (!options.checkpointPath.empty())
+		{
+			const std::chrono::duration<double> sinceCheckpoint = std::chrono::steady_clock::now() - lastCheckpointTime;
+			const bool isDue = (options.checkpointRounds > 0 && roundsPlayed() - lastCheckpointRounds >= options.checkpointRounds)
+				|| (checkpointSeconds > 0 && sinceCheckpoint.count() >= checkpointSeconds);
+
+			// Every worker is parked at the barrier, so their shoes can be read here. They haven't
+			// synced from the merged table yet, but they'll do that first thing after resuming too.
+			if (isDue || isResolved || epochsMerged == epochCount)
+				writeCheckpoint();
+		}
+
+		if (snapshotWriter && (roundsPlayed() - lastSnapshotRounds >= options.snapshotRounds || isResolved || epochsMerged == epochCount))
+		{
+			snapshotWriter->Submit(resultsTable, roundsPlayed());
+			lastSnapshotRounds = roundsPlayed();
+		}
+
+		if (options.stats && std::chrono::duration<double>(std::chrono::steady_clock::now() - lastStatsTime).count() >= options.statsSeconds)
+			printStats();
+	};
+
+	auto runWorker = [&](int workerIndex) {
+		TWorker& worker = *workers[workerIndex];
+		int remainingRounds = std::max(0, workerRounds[workerIndex] - firstEpoch * syncInterval);
+
+		// isResolved is only ever set inside the barrier, so every worker sees the same value here
+		for (int epoch = firstEpoch; epoch < epochCount && !isResolved; epoch++)
+		{
+			const int rounds = std::min(remainingRounds, syncInterval);
+			worker.RunRounds(rounds);
+			remainingRounds -= rounds;
+
+			// The next merge can't happen until every worker has arrived again, so it's safe
+			// for all of them to read the shared table here without holding the lock.
+			barrier.ArriveAndWait(mergeShards);
+			worker.SyncFrom(resultsTable);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < threadCount; i++)
+		threads.emplace_back(runWorker, i);
+
+	runWorker(0);
+
+	for (auto& thread : threads)
+		thread.join();
+
+	if (options.stats)
+		printStats();
+
+	// A corpus decides the cards whatever the seed, so its shard carries the corpus's seed. Runs
+	// over the same corpus then can't be merged, as they played the same rounds.
+	const ShardHeader shardHeader = hasCorpus ? MakeShardHeader(options, true, corpus.Seed(), roundsPlayed())
+		: MakeShardHeader(options, options.hasSeed, seed, roundsPlayed());
+	if (!options.shardPath.empty() && !WriteShard(options.shardPath, shardHeader, resultsTable))
+	{
+		std::cerr << "Failed to write shard " << options.shardPath << "\n";
+		return false;
+	}
+
+	return true;
+}
+
+template <typename TRules, typename TShoe>
+bool RunMarkovMonte(const SimulationOptions& options, ResultsTable& resultsTable)
+{
+	using Worker = MarkovMonteWorker<TRules, TShoe>;
+	return RunMarkovMonteWorkers<Worker>(options, resultsTable, [&](const ResultsTable& sharedTable, const RandomEngine& randomEngine, const CorpusStream& corpus) {
+		return std::make_unique<Worker>(sharedTable, options.rules, randomEngine, options.exactDealer, options.stats,
+			options.dealMode, GetConfidenceZ(options.confidence > 0 ? options.confidence : c_defaultAdaptiveConfidence), options.ciTolerance, corpus);
+	});
+}
+
+// A histogram of values which are whole multiples of a tenth, which every bankroll is: bets are
+// whole units, and every payout is a multiple of a half or a fifth. Counting each tenth separately
+// gives exact percentiles however many values go in, in space that only grows with their spread.
+class TenthsHistogram
+{
+public:
+	void Add(double value);
+	void Merge(const TenthsHistogram& other);
+
+	int64_t Count() const { return m_count; }
+
+	// The smallest value at least this fraction of the values are at or below
+	double Percentile(double fraction) const;
+
+private:
+	std::map<int64_t, int64_t> m_counts;    // By value in tenths
+	int64_t m_count = 0;
+};
+
+void TenthsHistogram::Add(double value)
+{
+	m_counts[std::llround(value * 10)]++;
+	m_count++;
+}
+
+void TenthsHistogram::Merge(const TenthsHistogram& other)
+{
+	for (const auto& bucket : other.m_counts)
+		m_counts[bucket.first] += bucket.second;
+	m_count += other.m_count;
+}
+
+double TenthsHistogram::Percentile(double fraction) const
+{
+	const double target = fraction * m_count;
+	int64_t atOrBelow = 0;
+	for (const auto& bucket : m_counts)
+	{
+		atOrBelow += bucket.second;
+		if (atOrBelow >= target)
+			return bucket.first / 10.0;
+	}
+	return m_counts.empty() ? 0.0 : m_counts.rbegin()->first / 10.0;
+}
+
+// What --sessions reports. Each worker streams its sessions into its own, and they're merged once
+// at the end, so nothing is kept per session.
+struct SessionStats
+{
+	int64_t sessions = 0;
+	int64_t ruined = 0;
+	int64_t hands = 0;
+	double finalSum = 0.0;
+	double finalSumOfSquares = 0.0;
+	double drawdownSum = 0.0;
+	TenthsHistogram finalBankrolls;
+	TenthsHistogram maxDrawdowns;       // Each session's largest fall from its highest bankroll so far
+
+	void Merge(const SessionStats& other);
+};
+
+void SessionStats::Merge(const SessionStats& other)
+{
+	sessions += other.sessions;
+	ruined += other.ruined;
+	hands += other.hands;
+	finalSum += other.finalSum;
+	finalSumOfSquares += other.finalSumOfSquares;
+	drawdownSum += other.drawdownSum;
+	finalBankrolls.Merge(other.finalBankrolls);
+	maxDrawdowns.Merge(other.maxDrawdowns);
+}
+
+// Plays whole sessions with a frozen policy: a starting bankroll, a bet for each true count, and a
+// fixed number of hands unless the bankroll can no longer cover the minimum bet. Every session
+// starts from a freshly shuffled shoe, so they're independent of one another. Bets are capped at
+// the bankroll, but doubles and splits are always allowed, even when the bankroll can't cover them.
+template <typename TRules>
+class SessionWorker
+{
+public:
+	SessionWorker(const PolicyTable& policy, const TableRules& rules, const RandomEngine& randomEngine, const SimulationOptions& options);
+
+	void RunSessions(int sessions);
+
+	const SessionStats& Stats() const { return m_stats; }
+
+private:
+	void RunSession();
+	double PlayRound(int countBucket);
+
+	const PolicyTable& m_policy;
+	ShuffledShoe m_shoe;
+	Player m_player;
+	int m_maxHands;
+	int m_sessionHands;
+	double m_bankroll;
+	std::array<int, c_trueCountBuckets> m_bets;     // In minimum bets, by count bucket
+	bool m_isCounting;      // Whether the bet or the policy depends on the count
+	SessionStats m_stats;
+};
+
+template <typename TRules>
+SessionWorker<TRules>::SessionWorker(const PolicyTable& policy, const TableRules& rules, const RandomEngine& randomEngine, const SimulationOptions& options)
+	: m_policy(policy)
+	, m_shoe(rules.decks, rules.penetration, randomEngine)
+	, m_player("Player 1", 0.0)
+	, m_maxHands(rules.maxHands)
+	, m_sessionHands(options.sessionHands)
+	, m_bankroll(options.bankroll)
+	, m_isCounting(!options.betSpread.empty() || policy.CountBuckets() > 1)
+{
+	// Later pairs are at higher counts, so they take over from the earlier ones
+	m_bets.fill(1);
+	for (int countBucket = 0; countBucket < c_trueCountBuckets; countBucket++)
+	{
+		for (const auto& countBet : options.betSpread)
+		{
+			if (GetTrueCount(countBucket) >= countBet.first)
+				m_bets[countBucket] = countBet.second;
+		}
+	}
+}
+
+template <typename TRules>
+void SessionWorker<TRules>::RunSessions(int sessions)
+{
+	for (int session = 0; session < sessions; session++)
+		RunSession();
+}
+
+template <typename TRules>
+void SessionWorker<TRules>::RunSession()
+{
+	m_shoe.Reshuffle();
+
+	double bankroll = m_bankroll;
+	double peak = bankroll;
+	double maxDrawdown = 0.0;
+	int hands = 0;
+
+	for (; hands < m_sessionHands && bankroll >= 1; hands++)
+	{
+		m_shoe.ReloadIfNecessary();
+
+		const int countBucket = m_isCounting ? GetTrueCountBucket(m_shoe.CurrentView().RemainingRanks()) : 0;
+		const double bet = std::min(static_cast<double>(m_bets[countBucket]), std::floor(bankroll));
+
+		bankroll += bet * PlayRound(m_policy.CountBuckets() > 1 ? countBucket : 0);
+		peak = std::max(peak, bankroll);
+		maxDrawdown = std::max(maxDrawdown, peak - bankroll);
+	}
+
+	m_stats.sessions++;
+	m_stats.ruined += bankroll < 1;
+	m_stats.hands += hands;
+	m_stats.finalSum += bankroll;
+	m_stats.finalSumOfSquares += bankroll * bankroll;
+	m_stats.drawdownSum += maxDrawdown;
+	m_stats.finalBankrolls.Add(bankroll);
+	m_stats.maxDrawdowns.Add(maxDrawdown);
+}
+
+// Returns the round's result per unit bet
+template <typename TRules>
+double SessionWorker<TRules>::PlayRound(int countBucket)
+{
+	DealerHand dealerHand;
+	PlayerHand playerHand(m_player, m_maxHands);
+
+	playerHand.AddCard(m_shoe.DealCard());
+	dealerHand.AddCard(m_shoe.DealCard());
+
+	playerHand.AddCard(m_shoe.DealCard());
+	dealerHand.AddCard(m_shoe.DealCard());
+
+	const PlayerSubHand& hand = playerHand.PrimaryHand();
+	Trace(c_traceRounds, TraceDeal(hand, dealerHand, countBucket, 0));
+
+	if (dealerHand.IsBlackjack())
+		return hand.IsBlackjack() ? 0.0 : -1.0;
+	else if (hand.IsBlackjack())
+		return TRules::c_blackjackPayout;
+
+	// Any action that leaves the hand live will do, so the policy plays it from the start
+	CompletePlayerOptimally<TRules>(dealerHand, playerHand, m_policy, countBucket, m_shoe, Action::Hit);
+	return CompleteDealer<TRules>(dealerHand, playerHand, m_shoe);
 }
 
-void PlayerSubHand::DoubleDown(Card card)
+void PrintSessionStats(const SessionStats& stats, const SimulationOptions& options)
 {
-	assert(m_cards.size() == 2);
-	m_bet *= 2;
-	AddCard(card);
+	constexpr double c_percentiles[] = { 0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99 };
+	auto printPercentiles = [&](const TenthsHistogram& histogram) {
+		std::cout << "  Percentiles:";
+		for (double percentile : c_percentiles)
+			std::cout << " " << 100 * percentile << "% " << histogram.Percentile(percentile);
+		std::cout << "\n";
+	};
+
+	const double sessions = static_cast<double>(stats.sessions);
+	const double riskOfRuin = stats.ruined / sessions;
+	const double finalMean = stats.finalSum / sessions;
+	const double finalVariance = std::max(0.0, stats.finalSumOfSquares / sessions - finalMean * finalMean);
+
+	std::cout << stats.sessions << " sessions of up to " << options.sessionHands << " hands from a bankroll of " << options.bankroll << " minimum bets\n";
+	std::cout << "Risk of ruin: " << 100 * riskOfRuin << "% (standard error " << 100 * std::sqrt(riskOfRuin * (1 - riskOfRuin) / sessions) << "%)\n";
+	std::cout << "Hands played: " << stats.hands / sessions << " per session\n";
+	std::cout << "Final bankroll: mean " << finalMean << ", standard deviation " << std::sqrt(finalVariance) << "\n";
+	printPercentiles(stats.finalBankrolls);
+	std::cout << "Max drawdown: mean " << stats.drawdownSum / sessions << "\n";
+	printPercentiles(stats.maxDrawdowns);
 }
 
-PlayerSubHand PlayerSubHand::Split(DeckShoeView & shoe)
+enum class AdviceStatus : uint8_t
 {
-	PlayerSubHand newHand(Owner());
+	Ok,
+	NoDecision,     // The hand can't act, like a 21 or a bust
+	Unreached,      // The table never played the hand against the upcard
+	Invalid,        // The query couldn't be read
+};
 
-	assert(CanSplit());
+// A binary --advise query. The query file is just these, back to back. Ranks run from 1 for an ace
+// to 10 for any ten.
+struct AdviceQuery
+{
+	uint8_t upcard;
+	uint8_t cardCount;      // 2 to 12
+	uint8_t hasTrueCount;   // Otherwise the table over every count answers
+	int8_t trueCount;       // Hi-Lo, clamped to +/-6 like --count
+	uint8_t cards[12];
+};
 
-	newHand.AddCard(m_cards[1]);
-	m_cards.pop_back();
+static_assert(sizeof(AdviceQuery) == 16, "AdviceQuery is a file format");
 
-	newHand.AddCard(shoe.DealCard());
-	AddCard(shoe.DealCard());
+// A binary --advise answer, written back to back in query order
+struct AdviceAnswer
+{
+	uint8_t action;         // An Action, when the status is Ok
+	uint8_t status;         // An AdviceStatus
+	uint16_t reserved;
+	float expectedValue;    // The action's mean result per unit bet
+	float margin;           // How far ahead of the next best allowed action it is
+};
 
-	SetIsFromSplit();
-	newHand.SetIsFromSplit();
+static_assert(sizeof(AdviceAnswer) == 12, "AdviceAnswer is a file format");
 
-	return newHand;
+// Every answer --advise can give, worked out up front from a table, in both binary and text form.
+// Each hand state that can act maps to a slot for its player hand and which of doubling and
+// splitting it's allowed, so a query is a walk through the hand state transitions and a lookup.
+// A table split by count gets an extra bucket after the counts', over every count, for queries
+// without one.
+class AdviceIndex
+{
+public:
+	AdviceIndex(const ResultsTable& resultsTable, const TableRules& rules);
+
+	const AdviceAnswer& Answer(const AdviceQuery& query) const;
+
+	// Appends the answer to one line of text queries: the hand's cards, the upcard and optionally
+	// the true count, separated by spaces, e.g. "A7 6" or "T,2 4 +3"
+	void AnswerText(const char* begin, const char* end, std::string& out) const;
+
+private:
+	static constexpr int c_maskSlots = 4;       // Whether doubling and splitting are allowed
+	static constexpr int c_bucketSlots = c_maxDealerHandIndex * c_maxPlayerHandIndex * c_maskSlots;
+
+	static AdviceAnswer MakeAnswer(const ResultsCell& cell, uint8_t actionMask);
+	static std::string MakeText(const AdviceAnswer& answer);
+
+	// Where the answer is, or -1 if the hand can't act
+	int Find(HandState state, int upcard, bool hasTrueCount, int trueCount) const;
+
+	int m_countBuckets;
+	std::vector<int16_t> m_slots;               // By hand state, -1 if the hand can't act
+	std::vector<AdviceAnswer> m_answers;        // [bucket][dealerHandIndex][playerHandIndex][mask slot]
+	std::vector<std::string> m_texts;           // The same, as lines of text
+	AdviceAnswer m_noDecision;
+	AdviceAnswer m_invalid;
+};
+
+AdviceIndex::AdviceIndex(const ResultsTable& resultsTable, const TableRules& rules)
+	: m_countBuckets(resultsTable.CountBuckets())
+	, m_slots(g_handStates.StateCount(), -1)
+	, m_noDecision{ 0, static_cast<uint8_t>(AdviceStatus::NoDecision), 0, 0.0f, 0.0f }
+	, m_invalid{ 0, static_cast<uint8_t>(AdviceStatus::Invalid), 0, 0.0f, 0.0f }
+{
+	const int maskIndex = DispatchRuleSet(rules, [](auto ruleSet) { return decltype(ruleSet)::c_actionMaskIndex; });
+
+	// Only dealt hands are queried, and they can always stand and hit until they're finished
+	for (HandState state = 0; state < g_handStates.StateCount(); state++)
+	{
+		const HandStateInfo& info = g_handStates.Info(state);
+		const uint8_t actionMask = info.actionMasks[maskIndex];
+		if (info.playerHandIndex >= 0 && !info.isFromSplit && (actionMask & ActionBit(Action::Hit)))
+			m_slots[state] = static_cast<int16_t>(info.playerHandIndex * c_maskSlots + (actionMask >> 2));
+	}
+
+	const ResultsTable combined = resultsTable.CombineCounts();
+	const int buckets = m_countBuckets == 1 ? 1 : m_countBuckets + 1;
+	for (int bucket = 0; bucket < buckets; bucket++)
+	{
+		for (int dealerHandIndex = 0; dealerHandIndex < c_maxDealerHandIndex; dealerHandIndex++)
+		{
+			for (int playerHandIndex = 0; playerHandIndex < c_maxPlayerHandIndex; playerHandIndex++)
+			{
+				const ResultsCell& cell = bucket < m_countBuckets
+					? resultsTable.GetCell(dealerHandIndex, playerHandIndex, bucket)
+					: combined.GetCell(dealerHandIndex, playerHandIndex);
+
+				for (int maskSlot = 0; maskSlot < c_maskSlots; maskSlot++)
+				{
+					const uint8_t actionMask = static_cast<uint8_t>(ActionBit(Action::Stand) | ActionBit(Action::Hit) | (maskSlot << 2));
+					m_answers.push_back(MakeAnswer(cell, actionMask));
+					m_texts.push_back(MakeText(m_answers.back()));
+				}
+			}
+		}
+	}
 }
 
-void PlayerSubHand::PayoutHand(double result)
+// The best of the allowed actions, ties going to the earlier action like PolicyTable
+AdviceAnswer AdviceIndex::MakeAnswer(const ResultsCell& cell, uint8_t actionMask)
 {
-	m_player.AdjustMoney(m_bet * result);
+	int best = -1;
+	int runnerUp = -1;
+	for (int action = 0; action < 4; action++)
+	{
+		const ResultData& data = cell.GetResultData(static_cast<Action>(action));
+		if (!(actionMask & ActionBit(static_cast<Action>(action))) || data.count == 0)
+			continue;
+
+		auto mean = [&](int other) { return cell.GetResultData(static_cast<Action>(other)).Mean(); };
+		if (best < 0 || data.Mean() > mean(best))
+		{
+			runnerUp = best;
+			best = action;
+		}
+		else if (runnerUp < 0 || data.Mean() > mean(runnerUp))
+		{
+			runnerUp = action;
+		}
+	}
+
+	if (best < 0)
+		return { 0, static_cast<uint8_t>(AdviceStatus::Unreached), 0, 0.0f, 0.0f };
+
+	const double bestMean = cell.GetResultData(static_cast<Action>(best)).Mean();
+	const double margin = runnerUp < 0 ? 0.0 : bestMean - cell.GetResultData(static_cast<Action>(runnerUp)).Mean();
+	return { static_cast<uint8_t>(best), static_cast<uint8_t>(AdviceStatus::Ok), 0, static_cast<float>(bestMean), static_cast<float>(margin) };
 }
 
-bool PlayerSubHand::CanHit() const
+std::string AdviceIndex::MakeText(const AdviceAnswer& answer)
 {
-	bool cantHit = IsBusted() || IsBlackjack() || (m_isFromSplit && m_cards[0].Face() == CardFace::Ace) || Value() >= 21;
-	return !cantHit;
+	switch (static_cast<AdviceStatus>(answer.status))
+	{
+		case AdviceStatus::Ok:
+			break;
+		case AdviceStatus::NoDecision:
+			return "None\n";
+		case AdviceStatus::Unreached:
+			return "Unreached\n";
+		default:
+			return "Invalid\n";
+	}
+
+	std::ostringstream text;
+	text << GetActionString(static_cast<Action>(answer.action)) << "\t" << answer.expectedValue << "\t" << answer.margin << "\n";
+	return text.str();
 }
 
+int AdviceIndex::Find(HandState state, int upcard, bool hasTrueCount, int trueCount) const
+{
+	const int slot = m_slots[state];
+	if (slot < 0)
+		return -1;
 
-double GetHandOutcome(const PlayerSubHand & playerHand, const Hand & dealerHand)
+	int bucket = 0;
+	if (m_countBuckets > 1)
+		bucket = hasTrueCount ? std::min(std::max(trueCount, -c_maxTrueCount), c_maxTrueCount) + c_maxTrueCount : m_countBuckets;
+
+	return (bucket * c_maxDealerHandIndex + MapDealerHandToActionIndex(upcard)) * (c_maxPlayerHandIndex * c_maskSlots) + slot;
+}
+
+// Ranks 1 for an ace through 10 deal as these faces
+CardFace RankFace(int rank)
 {
-	DebugOut(output << playerHand.PlayerName() << ": ");
-	if (playerHand.IsBusted())
-		return output << "Busted\n", -1;
-	else if (playerHand.IsBlackjack() && dealerHand.IsBlackjack())
-		return output << "Pushed\n", 0;
-	else if (dealerHand.IsBlackjack())
-		return output << "Lost\n", -1;
-	else if (playerHand.IsBlackjack())
-		return output << "Blackjack!\n", 1.5;
-	else if (dealerHand.IsBusted() || playerHand.Value() > dealerHand.Value())
-		return output << "Won!\n", 1.0;
-	else if (playerHand.Value() == dealerHand.Value())
-		return output << "Pushed!\n", 0.0;
-	else
-		return output << "Lost!\n", -1.0;
+	return static_cast<CardFace>(rank - 1);
 }
 
-enum class Action
+const AdviceAnswer& AdviceIndex::Answer(const AdviceQuery& query) const
 {
-	Stand,
-	Hit,
-	DoubleDown,
-	Split
-};
+	if (query.cardCount < 2 || query.cardCount > std::size(query.cards) || query.upcard < 1 || query.upcard > 10)
+		return m_invalid;
 
-const char* GetActionString(Action action)
+	HandState state = HandStateTable::c_emptyHand;
+	for (int i = 0; i < query.cardCount; i++)
+	{
+		if (query.cards[i] < 1 || query.cards[i] > 10)
+			return m_invalid;
+		state = g_handStates.Next(state, RankFace(query.cards[i]));
+	}
+
+	const int answer = Find(state, query.upcard, query.hasTrueCount != 0, query.trueCount);
+	return answer < 0 ? m_noDecision : m_answers[answer];
+}
+
+// A, 2 to 9, and T, J, Q, K or 10 for a ten, as 1 to 10. Anything else is 0.
+int ParseRank(const char*& p, const char* end)
 {
-	switch (action)
+	const char c = *p++;
+	if (c >= '2' && c <= '9')
+		return c - '0';
+
+	switch (c)
 	{
-		case Action::Stand:
-			return "Stand";
-		case Action::Hit:
-			return "Hit";
-		case Action::DoubleDown:
-			return "Double DOwn";
-		case Action::Split:
-			return "Split";
+		case 'A': case 'a':
+			return 1;
+		case 'T': case 't': case 'J': case 'j': case 'Q': case 'q': case 'K': case 'k':
+			return 10;
+		case '1':
+			if (p < end && *p == '0')
+				return ++p, 10;
+			return 0;
 		default:
-			return "ERROR";
+			return 0;
 	}
 }
 
-constexpr int c_maxPlayerHandIndex = 31;
-constexpr int c_maxDealerHandIndex = 10;
-
-int MapPlayerHandToActionIndex(const PlayerSubHand & hand)
+void AdviceIndex::AnswerText(const char* begin, const char* end, std::string& out) const
 {
-	// 0: 8 or less
-	// 1 - 12: 9 through 20
-	// 13 - 20: Soft 13 through 20
-	// 21 - 30: Double A through 10
+	auto isSpace = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+	auto skipSpaces = [&](const char*& p) { while (p < end && isSpace(*p)) p++; };
+	auto invalid = [&] { out += "Invalid\n"; };
 
-	const int handValue = hand.Value();
-	assert(handValue != 21);
-
-	if (hand.CanSplit() && hand.GetCard(0).Face() == CardFace::Ace)
-		return 21;
-	else if (hand.CanSplit())
-		return 20 + hand.GetCard(0).Value();
-	else if (hand.IsSoft() && handValue >= 13)
-		return handValue;
-	else if (handValue <= 8)
-		return 0; //compress uninteresting values
+	const char* p = begin;
+	skipSpaces(p);
+
+	HandState state = HandStateTable::c_emptyHand;
+	int cardCount = 0;
+	for (; p < end && !isSpace(*p); cardCount++)
+	{
+		if (*p == ',' && cardCount > 0 && ++p == end)
+			return invalid();
+
+		const int rank = ParseRank(p, end);
+		if (rank == 0)
+			return invalid();
+		state = g_handStates.Next(state, RankFace(rank));
+	}
+
+	skipSpaces(p);
+	if (cardCount < 2 || p == end)
+		return invalid();
+
+	const int upcard = ParseRank(p, end);
+	if (upcard == 0 || (p < end && !isSpace(*p)))
+		return invalid();
+
+	skipSpaces(p);
+	const bool hasTrueCount = p < end;
+	int trueCount = 0;
+	if (hasTrueCount)
+	{
+		const bool isNegative = *p == '-';
+		if (*p == '-' || *p == '+')
+			p++;
+		if (p == end || *p < '0' || *p > '9')
+			return invalid();
+
+		for (; p < end && *p >= '0' && *p <= '9'; p++)
+			trueCount = std::min(trueCount * 10 + (*p - '0'), 100);
+		if (isNegative)
+			trueCount = -trueCount;
+
+		skipSpaces(p);
+		if (p < end)
+			return invalid();
+	}
+
+	const int answer = Find(state, upcard, hasTrueCount, trueCount);
+	if (answer < 0)
+		out += "None\n";
 	else
-		return handValue - 8;
+		out += m_texts[answer];
 }
 
-// DealerHand actions:
-//  2-10 = 0-8
-//  A = 9
-int MapDealerHandToActionIndex(int dealerCardValue)
+// Prints the table, and for a --count run each count's table after it
+void PrintResults(const ResultsTable& resultsTable, double confidenceZ)
 {
-	if (dealerCardValue == 1)
-		return 9;
-	else
-		return dealerCardValue - 2;
+	if (resultsTable.CountBuckets() == 1)
+	{
+		PrintResultsTable(resultsTable, confidenceZ);
+		return;
+	}
+
+	// The table over every count first, in the usual format, then each count that came up
+	PrintResultsTable(resultsTable.CombineCounts(), confidenceZ);
+	for (int countBucket = 0; countBucket < resultsTable.CountBuckets(); countBucket++)
+	{
+		if (resultsTable.IsCountBucketEmpty(countBucket))
+			continue;
+
+		const int trueCount = GetTrueCount(countBucket);
+		std::cout << "\nTrue count " << (trueCount > 0 ? "+" : "") << trueCount
+			<< (trueCount == -c_maxTrueCount ? " or less" : trueCount == c_maxTrueCount ? " or more" : "") << "\n";
+		PrintResultsTable(resultsTable, confidenceZ, countBucket);
+	}
 }
 
-std::string GetNextAction(DealerHand & dealer, PlayerHand & player)
+// How often each cell comes up from a fresh shoe, dealt player, dealer, player, dealer
+struct NaturalDealFrequencies
 {
-	return "s";
+	double playerBlackjack = 0;    // Player only, the dealer doesn't have one
+	double dealerBlackjack = 0;    // Dealer only
+	std::array<std::array<double, c_maxDealerHandIndex>, c_maxPlayerHandIndex> cells = {};
+};
+
+NaturalDealFrequencies GetNaturalDealFrequencies(int decks, bool isInfinite)
+{
+	NaturalDealFrequencies frequencies;
+	std::array<int, 13> faceCounts;
+	faceCounts.fill(4 * decks);
+	int cardsRemaining = 52 * decks;
+
+	// Draws a face, returning its probability, and puts it back when done
+	auto draw = [&](int face) {
+		const double probability = isInfinite ? 1.0 / 13 : double(faceCounts[face]) / cardsRemaining;
+		faceCounts[face]--;
+		cardsRemaining--;
+		return probability;
+	};
+	auto replace = [&](int face) {
+		faceCounts[face]++;
+		cardsRemaining++;
+	};
+
+	auto next = [](HandState state, int face) { return g_handStates.Next(state, static_cast<CardFace>(face)); };
+	for (int first = 0; first < 13; first++)
+	{
+		const double firstProbability = draw(first);
+		for (int hole = 0; hole < 13; hole++)
+		{
+			const double holeProbability = firstProbability * draw(hole);
+			for (int second = 0; second < 13; second++)
+			{
+				const double secondProbability = holeProbability * draw(second);
+				for (int upcard = 0; upcard < 13; upcard++)
+				{
+					const double probability = secondProbability * draw(upcard);
+					replace(upcard);
+
+					const HandStateInfo& player = g_handStates.Info(next(next(HandStateTable::c_emptyHand, first), second));
+					const bool isDealerBlackjack = g_handStates.Info(next(next(HandStateTable::c_emptyHand, hole), upcard)).isBlackjack;
+					if (player.isBlackjack && !isDealerBlackjack)
+						frequencies.playerBlackjack += probability;
+					else if (isDealerBlackjack && !player.isBlackjack)
+						frequencies.dealerBlackjack += probability;
+					else if (!player.isBlackjack)
+						frequencies.cells[player.playerHandIndex][MapDealerHandToActionIndex(std::min(upcard + 1, 10))] += probability;
+				}
+				replace(second);
+			}
+			replace(hole);
+		}
+		replace(first);
+	}
+
+	return frequencies;
 }
 
-bool RunOneRoundInteractively(MasterDeckShoeView & shoe, std::vector<Player> & players)
+// For --stratify and --adaptive, which don't deal cells as often as they come up naturally. The
+// overall expectation weights each cell's best action by how often the cell is dealt naturally.
+void PrintStratifiedExpectedValue(const ResultsTable& resultsTable, const SimulationOptions& options)
 {
-	DealerHand dealerHand;
-	std::list<PlayerSubHand> playerHands;
+	const ResultsTable table = resultsTable.CombineCounts();
+	const NaturalDealFrequencies frequencies = GetNaturalDealFrequencies(options.rules.decks, options.shoeType == ShoeType::Infinite);
+	const double blackjackPayout = DispatchRuleSet(options.rules, [](auto ruleSet) { return decltype(ruleSet)::c_blackjackPayout; });
 
-	shoe.ReloadIfNecessary();
+	constexpr std::array<Action, 4> allActions = { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+	double expectedValue = frequencies.playerBlackjack * blackjackPayout - frequencies.dealerBlackjack;
+	double missingFrequency = 0;
+	for (int playerHandIndex = 0; playerHandIndex < c_maxPlayerHandIndex; playerHandIndex++)
+	{
+		for (int dealerHandIndex = 0; dealerHandIndex < c_maxDealerHandIndex; dealerHandIndex++)
+		{
+			const ResultsCell& cell = table.GetCell(dealerHandIndex, playerHandIndex);
+			bool isVisited = false;
+			double bestMean = 0;
+			for (Action action : allActions)
+			{
+				const ResultData& data = cell.GetResultData(action);
+				if (data.count == 0)
+					continue;
 
-	for (auto & player : players)
+				const double mean = data.result / data.count;
+				bestMean = isVisited ? std::max(bestMean, mean) : mean;
+				isVisited = true;
+			}
+
+			const double frequency = frequencies.cells[playerHandIndex][dealerHandIndex];
+			if (isVisited)
+				expectedValue += frequency * bestMean;
+			else
+				missingFrequency += frequency;
+		}
+	}
+
+	std::cerr << "Expected value per round: " << expectedValue;
+	if (missingFrequency > 0)
+		std::cerr << " (missing cells dealt " << missingFrequency * 100 << "% of the time)";
+	std::cerr << "\n";
+}
+
+int DoExactEv(const SimulationOptions& options)
+{
+	const ResultsTable resultsTable = DispatchRuleSet(options.rules, [&](auto ruleSet) {
+		ExactEvEngine<decltype(ruleSet)> engine(options.rules.decks);
+		return engine.Compute();
+	});
+
+	// The computed table is the run's one and only snapshot
+	if (!options.snapshotPath.empty())
 	{
-		playerHands.emplace_back(player);
+		SnapshotWriter snapshotWriter(options.snapshotPath, options.snapshotFormat, false);
+		if (!snapshotWriter.IsOpen())
+		{
+			std::cerr << "Can't open " << options.snapshotPath << "\n";
+			return 1;
+		}
+		snapshotWriter.Submit(resultsTable, 0);
 	}
 
-	for (auto & hand : playerHands)
+	PrintResultsTable(resultsTable);
+	return 0;
+}
+
+int DoMarkovMonte(const SimulationOptions& options)
+{
+	ResultsTable resultsTable(GetCountBuckets(options));
+
+	// Everything from here down is compiled separately for each rule set
+	const bool isCompleted = DispatchRuleSet(options.rules, [&](auto ruleSet) {
+		using TRules = decltype(ruleSet);
+		if (options.batchLanes > 0)
+		{
+			using Worker = BatchMarkovMonteWorker<TRules>;
+			return RunMarkovMonteWorkers<Worker>(options, resultsTable, [&](const ResultsTable& sharedTable, const RandomEngine& randomEngine, const CorpusStream& corpus) {
+				return std::make_unique<Worker>(sharedTable, options.rules, randomEngine, options.batchLanes, options.stats, corpus);
+			});
+		}
+
+		switch (options.shoeType)
+		{
+			case ShoeType::Composition:
+				return RunMarkovMonte<TRules, CompositionShoe>(options, resultsTable);
+			case ShoeType::Infinite:
+				return RunMarkovMonte<TRules, InfiniteShoe>(options, resultsTable);
+			default:
+				return RunMarkovMonte<TRules, ShuffledShoe>(options, resultsTable);
+		}
+	});
+
+	if (!isCompleted)
+		return 1;
+
+	if (options.dealMode != DealMode::Natural)
+		PrintStratifiedExpectedValue(resultsTable, options);
+
+	PrintResults(resultsTable, options.confidence > 0 ? GetConfidenceZ(options.confidence) : 0.0);
+	return 0;
+}
+
+// Shuffles the shoes exactly as a run with the same seed and --decks would shuffle its first
+// worker's, and writes them out one after another
+int DoWriteCorpus(const SimulationOptions& options)
+{
+	CorpusHeader header = {};
+	memcpy(header.magic, c_corpusMagic, sizeof(header.magic));
+	header.version = c_corpusVersion;
+	header.decks = options.rules.decks;
+	header.shoeCount = options.corpusShoes;
+	header.seed = ChooseSeed(options);
+
+	DeckShoe shoe(options.rules.decks, RandomEngine(header.seed));
+	const bool isWritten = WriteFileAtomically(options.writeCorpusPath, [&](std::ostream& out) {
+		WriteRaw(out, header);
+		for (uint64_t i = 0; i < header.shoeCount; i++)
+		{
+			if (i != 0)
+				shoe.Reload();
+			shoe.WriteCards(out);
+		}
+	});
+
+	if (!isWritten)
 	{
-		hand.AddCard(shoe.DealCard());
+		std::cerr << "Failed to write corpus " << options.writeCorpusPath << "\n";
+		return 1;
 	}
-	dealerHand.AddCard(shoe.DealCard());
 
-	for (auto & hand : playerHands)
+	std::cerr << "Wrote " << header.shoeCount << " shoes of " << header.decks << " decks with seed " << header.seed << "\n";
+	return 0;
+}
+
+// A --trace file: this header, then for each thread a uint64 record count and its records
+// oldest first
+struct TraceHeader
+{
+	char magic[8];
+	uint32_t version;
+	int32_t level;          // The BLACKJACKSIM_TRACE_LEVEL it was traced at
+	uint32_t threads;
+	uint32_t recordSize;
+};
+
+constexpr char c_traceMagic[8] = "BJSTRCE";
+constexpr uint32_t c_traceVersion = 1;
+
+// Only once every thread that traced is done
+bool WriteTrace(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(g_traceMutex);
+
+	TraceHeader header = {};
+	memcpy(header.magic, c_traceMagic, sizeof(header.magic));
+	header.version = c_traceVersion;
+	header.level = c_traceLevel;
+	header.threads = static_cast<uint32_t>(g_traceRings.size());
+	header.recordSize = sizeof(TraceRecord);
+
+	const bool isWritten = WriteFileAtomically(path, [&](std::ostream& out) {
+		WriteRaw(out, header);
+		for (const auto& ring : g_traceRings)
+			ring->Save(out);
+	});
+
+	if (!isWritten)
 	{
-		hand.AddCard(shoe.DealCard());
+		std::cerr << "Failed to write trace " << path << "\n";
+		return false;
 	}
-	dealerHand.AddCard(shoe.DealCard());
 
-	//output << "*******************************************" << std::endl;
-	for (auto & hand : playerHands)
+	return true;
+}
+
+void PrintTraceRecord(const TraceRecord& record)
+{
+	constexpr const char* c_faceNames[13] = { "A", "2", "3", "4", "5", "6", "7", "8", "9", "10", "J", "Q", "K" };
+	constexpr const char* c_outcomeNames[] = { "Busted", "Pushed blackjacks", "Lost to blackjack", "Blackjack", "Won", "Pushed", "Lost" };
+
+	auto card = [&](uint8_t face) { return face < 13 ? c_faceNames[face] : "-"; };
+	auto action = [&](uint8_t a) { return GetActionString(static_cast<Action>(a)); };
+	const uint8_t* args = record.args;
+
+	switch (record.event)
 	{
-		std::cout << "Dealer showing: " << dealerHand.ToString() << " (" << dealerHand.Showing() << ")" << std::endl;
-		std::cout << hand.PlayerName() <<  "'s hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl;
+		case TraceEvent::Reload:
+			std::cout << "Reload after " << record.value << " cards";
+			break;
+		case TraceEvent::Deal:
+			std::cout << "Deal to seat " << int(args[5]) << ": " << card(args[0]) << " " << card(args[1]) << " against " << card(args[2])
+				<< ", hole card " << card(args[3]) << ", count bucket " << int(args[4]);
+			break;
+		case TraceEvent::Action:
+			std::cout << action(args[0]);
+			if (args[1] != 0xFF)
+				std::cout << ", drew " << card(args[1]);
+			std::cout << ", hand is " << int(args[2]);
+			break;
+		case TraceEvent::Dealer:
+			std::cout << "Dealer " << card(args[0]) << " " << card(args[1]) << " finished on " << int(args[2]) << " with " << int(args[3]) << " cards";
+			break;
+		case TraceEvent::Outcome:
+			std::cout << (args[0] < std::size(c_outcomeNames) ? c_outcomeNames[args[0]] : "Unknown outcome") << ", " << int(args[1]) << " against "
+				<< int(args[2]) << ": " << record.value;
+			break;
+		case TraceEvent::Result:
+			std::cout << "Recorded player hand " << int(args[1]) << " against dealer hand " << int(args[0]) << ", " << action(args[2])
+				<< ", count bucket " << int(args[3]) << ": " << record.value;
+			break;
+		default:
+			std::cout << "Unknown event " << int(record.event);
+			break;
+	}
+}
 
-		while (hand.CanHit() && !dealerHand.IsBlackjack())
-		{
-			std::cout << "Action ((h)it, (s)tand, s(p)lit, (d)ouble down)? ";
-			std::string userAction;
-			std::cin >> userAction;
+// Prints every thread's records from a --trace file, one line each, a thread at a time
+int DoDecodeTrace(const SimulationOptions& options)
+{
+	std::ifstream in(options.decodeTracePath, std::ios::binary);
+	if (!in)
+	{
+		std::cerr << "Can't open " << options.decodeTracePath << "\n";
+		return 1;
+	}
 
-			Action action;
-			if (userAction == "h") action = Action::Hit;
-			else if (userAction == "s") action = Action::Stand;
-			else if (userAction == "p") action = Action::Split;
-			else if (userAction == "d") action = Action::DoubleDown;
-			else continue;
+	TraceHeader header;
+	if (!ReadRaw(in, header) || memcmp(header.magic, c_traceMagic, sizeof(header.magic)) != 0 || header.version != c_traceVersion
+		|| header.recordSize != sizeof(TraceRecord))
+	{
+		std::cerr << options.decodeTracePath << " isn't a trace from this build\n";
+		return 1;
+	}
 
-			if ((action == Action::DoubleDown && !hand.CanDoubleDown()) || (action == Action::Split && !hand.CanSplit()))
-			{
-				std::cout << "Can't " << GetActionString(action) << " right now\n";
-			}
+	std::cout << "Traced at level " << header.level << " by " << header.threads << " threads\n";
 
-			if (action == Action::Hit)
-			{
-				std::cout << "Hitting\n";
-				hand.AddCard(shoe.DealCard());
-				std::cout << hand.PlayerName() <<  "'s hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl;
-			}
-			else if (action == Action::Stand)
-			{
-				std::cout << "Standing\n";
-				break;
-			}
-			else if (action == Action::Split && hand.CanSplit())
-			{
-				// TODO
-				playerHands.emplace_back(hand.Split(shoe));
-				std::cout << hand.PlayerName() <<  "'s hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl;
-			}
-			else if (action == Action::Split)
-			{
-				std::cout << "Hand not split-able" << std::endl;
-			}
-			else if (action == Action::DoubleDown)
-			{
-				const Card card = shoe.DealCard();
-				hand.DoubleDown(card);
-				std::cout << hand.PlayerName() <<  "'s hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl;
-				break;
-			}
+	std::vector<TraceRecord> records;
+	for (uint32_t thread = 0; thread < header.threads; thread++)
+	{
+		uint64_t count;
+		if (!ReadRaw(in, count) || count > TraceRing::c_records)
+		{
+			std::cerr << options.decodeTracePath << " is truncated\n";
+			return 1;
 		}
-	}
 
-	// TODO: check for all players busted
-	dealerHand.FlipHiddenCard();
+		records.resize(count);
+		if (!in.read(reinterpret_cast<char*>(records.data()), count * sizeof(TraceRecord)))
+		{
+			std::cerr << options.decodeTracePath << " is truncated\n";
+			return 1;
+		}
 
-	std::cout << "Dealer: " << dealerHand.ToString() << " (" << dealerHand.Value() << ")" << std::endl;
+		for (const TraceRecord& record : records)
+		{
+			std::cout << "Thread " << thread << " round " << record.round << ": ";
+			PrintTraceRecord(record);
+			std::cout << "\n";
+		}
+	}
+
+	return 0;
+}
 
-	while (dealerHand.Value() < 17 || (dealerHand.Value() == 17 && dealerHand.IsSoft()))
+// Says why on stderr if the file isn't a whole shard from this build
+bool ReadShard(const std::string& path, ShardHeader& header, ResultsTable& resultsTable)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
 	{
-		auto card = shoe.DealCard();
-		dealerHand.AddCard(card);
-		output << "Dealer: " << dealerHand.ToString() << " (" << dealerHand.Value() << ")" << std::endl;
+		std::cerr << "Can't open " << path << "\n";
+		return false;
 	}
 
-	for (auto & player : players)
+	if (!ReadRaw(in, header) || memcmp(header.magic, c_shardMagic, sizeof(header.magic)) != 0 || header.version != c_shardVersion
+		|| header.tableSize != sizeof(ResultsCell) * c_maxPlayerHandIndex * c_maxDealerHandIndex || (header.countBuckets != 1 && header.countBuckets != c_trueCountBuckets))
 	{
-		player.SignalNewHand();
+		std::cerr << path << " isn't a shard from this build\n";
+		return false;
 	}
 
-	for (auto & hand : playerHands)
+	resultsTable = ResultsTable(header.countBuckets);
+	if (!resultsTable.Load(in))
 	{
-		std::cout << std::endl;
-		std::cout << hand.PlayerName() <<  "'s final hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl;
-		const double outcome = GetHandOutcome(hand, dealerHand);
-
-		hand.PayoutHand(outcome);
-		std::cout << "Payout: " << hand.Bet() * outcome << " (" << hand.Owner().Money() << ")\n\n";
+		std::cerr << path << " is truncated\n";
+		return false;
 	}
 
 	return true;
 }
 
-void PlayInteractively()
+// Reads every shard and checks they can be merged before adding any of them up
+int DoMerge(const SimulationOptions& options)
 {
-	DeckShoe shoeCards(6);
-	MasterDeckShoeView shoe(shoeCards);
-	Player dealer(std::string("Dealer"), 0);
+	ShardHeader merged = {};
+	ResultsTable resultsTable;
+	std::vector<uint64_t> seeds;
 
-	std::vector<Player> players;
+	for (size_t i = 0; i < options.mergePaths.size(); i++)
+	{
+		const std::string& path = options.mergePaths[i];
+		ShardHeader header;
+		ResultsTable shardTable;
+		if (!ReadShard(path, header, shardTable))
+			return 1;
 
-	double bestExpectedValue = -100;
+		if (i == 0)
+		{
+			merged = header;
+			resultsTable = ResultsTable(header.countBuckets);
+		}
+		else if (header.shoeType != merged.shoeType || header.exactDealer != merged.exactDealer
+			|| header.countBuckets != merged.countBuckets || !(header.rules == merged.rules))
+		{
+			std::cerr << path << " was written with a different --shoe, --dealer, --count or table rules than " << options.mergePaths[0] << "\n";
+			return 1;
+		}
 
-	players.emplace_back("Player 1", 0.0);
-	//players.emplace_back("Player 2", 500.0);
+		// Runs with the same seed played the same rounds, so merging them would count those twice
+		if (header.hasSeed && std::find(seeds.begin(), seeds.end(), header.seed) != seeds.end())
+		{
+			std::cerr << path << " has the same seed as an earlier shard\n";
+			return 1;
+		}
+		if (header.hasSeed)
+			seeds.push_back(header.seed);
 
+		resultsTable.Merge(shardTable);
+		if (i != 0)
+			merged.rounds += header.rounds;
+	}
 
-	bool fRunMore = true;
+	std::cerr << "Merged " << options.mergePaths.size() << " shards, " << merged.rounds << " rounds\n";
 
-	//while (fRunMore)
-	for (;;)
+	merged.hasSeed = false;
+	merged.seed = 0;
+	if (!options.shardPath.empty() && !WriteShard(options.shardPath, merged, resultsTable))
 	{
-		players[0].ClearStats();
-
-		fRunMore = RunOneRoundInteractively(shoe, players);
+		std::cerr << "Failed to write shard " << options.shardPath << "\n";
+		return 1;
 	}
-}
 
-bool CanDoAction(const PlayerSubHand& hand, Action action)
-{
-	switch (action)
-	{
-		case Action::Hit:
-			return hand.CanHit();
-		case Action::Stand:
-			return true;
-		case Action::DoubleDown:
-			return hand.CanDoubleDown();
-		case Action::Split:
-			return hand.CanSplit();
-		default:
-			throw std::runtime_error("Unexpected action");
-	}
+	PrintResults(resultsTable, options.confidence > 0 ? GetConfidenceZ(options.confidence) : 0.0);
+	return 0;
 }
 
-void DoAction(PlayerHand& playerHand, PlayerSubHand& subHand, Action action, DeckShoeView& shoe)
+// For a table split by count, fills the cells a count never reached with what was learned over
+// every count, so playing from the table never lands on an empty cell
+void FillUnreachedCounts(ResultsTable& resultsTable)
 {
-	switch (action)
-	{
-		case Action::Hit:
-		{
-			const Card card = shoe.DealCard();
-			subHand.AddCard(card);
+	if (resultsTable.CountBuckets() == 1)
+		return;
 
-			DebugOut(output << "Hit. " << card.ToString() << "(" << subHand.Value() << "), ");
-			break;
-		}
-		case Action::Stand:
-			DebugOut(output << "Stand.");
-			break;
-		case Action::DoubleDown:
+	const ResultsTable combined = resultsTable.CombineCounts();
+	for (int countBucket = 0; countBucket < resultsTable.CountBuckets(); countBucket++)
+	{
+		for (int playerHandIndex = 0; playerHandIndex < c_maxPlayerHandIndex; playerHandIndex++)
 		{
-			const Card card = shoe.DealCard();
-			subHand.DoubleDown(card);
-			DebugOut(output << "Double Down. " << card.ToString() << "(" << subHand.Value() << "), ");
-			break;
+			for (int dealerHandIndex = 0; dealerHandIndex < c_maxDealerHandIndex; dealerHandIndex++)
+			{
+				if (resultsTable.GetCell(dealerHandIndex, playerHandIndex, countBucket).GetResultData(Action::Stand).count == 0)
+					resultsTable.MergeCell(dealerHandIndex, playerHandIndex, combined.GetCell(dealerHandIndex, playerHandIndex), countBucket);
+			}
 		}
-		case Action::Split:
-			DebugOut(output << "Split.");
-			playerHand.Split(subHand, shoe);
-			break;
-		default:
-			throw std::runtime_error("Unexpected action");
 	}
 }
 
-struct ResultData
-{
-	double result = 0.0;
-	int count = 0;
-};
-
-class ResultsCell
+// Plays the sessions with the best actions in the --policy shard, split across the threads, under
+// the table rules the shard was made with
+int DoSessions(const SimulationOptions& options)
 {
-public:
-	const ResultData& GetResultData(Action action) const;
-	void AddResult(Action action, double result);
-private:
-	ResultData m_actionResults[4];
-};
+	ShardHeader header;
+	ResultsTable resultsTable;
+	if (!ReadShard(options.policyPath, header, resultsTable))
+		return 1;
 
-const ResultData& ResultsCell::GetResultData(Action action) const
-{
-	return m_actionResults[static_cast<int>(action)];
-}
+	FillUnreachedCounts(resultsTable);
+	const PolicyTable policy(resultsTable);
 
-void ResultsCell::AddResult(Action action, double result)
-{
-	m_actionResults[static_cast<int>(action)].count++;
-	m_actionResults[static_cast<int>(action)].result += result;
-}
+	int threadCount = options.threads;
+	if (threadCount <= 0)
+		threadCount = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
 
-class ResultsTable
-{
-public:
-	const ResultsCell& GetCell(int dealerHandIndex, int playerHandIndex) const;
-	void RecordResult(int dealerHandIndex, int playerHandIndex, Action action, double result);
+	std::vector<int> workerSessions(threadCount, options.sessions / threadCount);
+	for (int i = 0; i < options.sessions % threadCount; i++)
+		workerSessions[i]++;
 
-private:
-	ResultsCell m_results[c_maxPlayerHandIndex][c_maxDealerHandIndex];
-};
+	RandomEngine randomEngine(ChooseSeed(options));
+	SessionStats stats;
+	const auto startTime = std::chrono::steady_clock::now();
 
-const ResultsCell& ResultsTable::GetCell(int dealerHandIndex, int playerHandIndex) const
-{
-	return m_results[playerHandIndex][dealerHandIndex];
-}
+	DispatchRuleSet(header.rules, [&](auto ruleSet) {
+		using Worker = SessionWorker<decltype(ruleSet)>;
 
-void ResultsTable::RecordResult(int dealerHandIndex, int playerHandIndex, Action action, double result)
-{
-	m_results[playerHandIndex][dealerHandIndex].AddResult(action, result);
-}
+		std::vector<std::unique_ptr<Worker>> workers;
+		for (int i = 0; i < threadCount; i++)
+		{
+			workers.push_back(std::make_unique<Worker>(policy, header.rules, randomEngine, options));
+			randomEngine.Jump();
+		}
 
-Action GetOptimalAction(const ResultsTable& resultTable, int dealerHandIndex, const PlayerSubHand& playerHand)
-{
-	const int playerHandIndex = MapPlayerHandToActionIndex(playerHand);
-	const ResultsCell& cell = resultTable.GetCell(dealerHandIndex, playerHandIndex);
+		std::vector<std::thread> threads;
+		for (int i = 1; i < threadCount; i++)
+			threads.emplace_back([&, i] { workers[i]->RunSessions(workerSessions[i]); });
 
-	std::array<Action, 4> allActions { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
-	Action optimalAction = Action::Stand;
-	double optimalResult = std::numeric_limits<double>::min();
+		workers[0]->RunSessions(workerSessions[0]);
 
-	for (Action action : allActions)
-	{
-		const ResultData& data = cell.GetResultData(action);
-		if (data.count == 0 || !CanDoAction(playerHand, action))
-			continue;
+		for (auto& thread : threads)
+			thread.join();
 
-		const double adjustedResult = data.result / data.count;
+		// In worker order, so a seed and thread count always give the same figures
+		for (const auto& worker : workers)
+			stats.Merge(worker->Stats());
+	});
 
-		if (adjustedResult > optimalResult)
-		{
-			optimalResult = adjustedResult;
-			optimalAction = action;
-		}
-	}
+	const double elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	std::cerr << "Played " << stats.sessions << " sessions, " << stats.hands << " hands, in " << elapsedSeconds << "s ("
+		<< static_cast<int64_t>(stats.hands / std::max(1e-9, elapsedSeconds)) << " hands/s)\n";
 
-	return optimalAction;
+	PrintSessionStats(stats, options);
+	return 0;
 }
 
-double CompleteOptimally(DealerHand& dealerHand, PlayerHand& hand, const ResultsTable& resultTable, DeckShoeView& shoe, Action lastAction)
+// Answers a line of text per line of stdin, reading and writing in large blocks. A line too long
+// for the buffer can't be a real query, so it's answered as one invalid line.
+int64_t AnswerTextQueries(const AdviceIndex& index)
 {
-	double result = 0.0;
-	auto& subHands = hand.SubHands();
-	const int dealerHandIndex = MapDealerHandToActionIndex(dealerHand.Showing());
+	constexpr size_t c_bufferSize = 1 << 20;
+
+	std::vector<char> buffer(c_bufferSize);
+	std::string out;
+	out.reserve(2 * c_bufferSize);
 
-	if (lastAction != Action::Stand)
+	int64_t queries = 0;
+	size_t carried = 0;
+	for (;;)
 	{
-		for (auto& subHand : subHands)
+		const size_t read = std::fread(buffer.data() + carried, 1, buffer.size() - carried, stdin);
+		const char* p = buffer.data();
+		const char* end = p + carried + read;
+
+		while (const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p)))
 		{
-			while (subHand.CanHit())
-			{
-				Action optimalAction;
+			index.AnswerText(p, newline, out);
+			queries++;
+			p = newline + 1;
+		}
 
-				do {
-					optimalAction = GetOptimalAction(resultTable, dealerHandIndex, subHand);
-				} while (!CanDoAction(subHand, optimalAction));
+		if (read == 0 || p == buffer.data())
+		{
+			// The end of the input, or a line that filled the buffer
+			if (p < end)
+			{
+				index.AnswerText(p, end, out);
+				queries++;
+			}
+			p = end;
+		}
 
-				DoAction(hand, subHand, optimalAction, shoe);
+		carried = end - p;
+		std::memmove(buffer.data(), p, carried);
 
-				if (optimalAction == Action::Stand)
-					break;
-			}
+		if (out.size() >= c_bufferSize || read == 0)
+		{
+			std::cout.write(out.data(), out.size());
+			out.clear();
 		}
+
+		if (read == 0)
+			break;
 	}
 
-	dealerHand.FlipHiddenCard();
-	while (dealerHand.Value() < 17 || (dealerHand.Value() == 17 && dealerHand.IsSoft()))
+	std::cout.flush();
+	return queries;
+}
+
+// Answers the AdviceQuery records in the queries file with AdviceAnswer records in the answers
+// file, a block at a time. Returns -1 after saying why on stderr if either file fails.
+int64_t AnswerBinaryQueries(const AdviceIndex& index, const std::string& queriesPath, const std::string& answersPath)
+{
+	std::ifstream in(queriesPath, std::ios::binary);
+	if (!in)
 	{
-		auto card = shoe.DealCard();
-		dealerHand.AddCard(card);
+		std::cerr << "Can't open " << queriesPath << "\n";
+		return -1;
 	}
-	DebugOut(output << "\nDealer Final Hand: " << dealerHand.ToString() << " (" << dealerHand.Value() << ")" << std::endl);
 
-	for (auto& subHand : subHands)
+	std::ofstream out(answersPath, std::ios::binary);
+	if (!out)
 	{
-		const double outcome = GetHandOutcome(subHand, dealerHand);
-		result += subHand.Bet() * outcome;
+		std::cerr << "Can't write " << answersPath << "\n";
+		return -1;
 	}
 
-	return result;
-}
-
-void PrintResultsTable(const ResultsTable& results)
-{
-	constexpr std::array<Action, 4> allActions = { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
+	constexpr size_t c_blockQueries = 1 << 16;
+	std::vector<AdviceQuery> queries(c_blockQueries);
+	std::vector<AdviceAnswer> answers(c_blockQueries);
 
-	for (int i=0; i < c_maxPlayerHandIndex; i++)
+	int64_t total = 0;
+	while (in)
 	{
-		for (Action a : allActions)
+		in.read(reinterpret_cast<char*>(queries.data()), c_blockQueries * sizeof(AdviceQuery));
+		const size_t bytes = static_cast<size_t>(in.gcount());
+		if (bytes % sizeof(AdviceQuery) != 0)
 		{
-			for (int j = 0; j < c_maxDealerHandIndex; j++)
-			{
-				const ResultsCell& cell = results.GetCell(j, i);
-				const ResultData& data = cell.GetResultData(a);
+			std::cerr << queriesPath << " ends partway through a query\n";
+			return -1;
+		}
 
-				if (data.count == 0)
-					std::cout << "";
-				else
-					std::cout << data.result / data.count;
+		const size_t count = bytes / sizeof(AdviceQuery);
+		for (size_t i = 0; i < count; i++)
+			answers[i] = index.Answer(queries[i]);
 
-				std::cout << "\t";
-			}
-			std::cout << "\n";
-		}
+		out.write(reinterpret_cast<const char*>(answers.data()), count * sizeof(AdviceAnswer));
+		total += count;
 	}
+
+	if (!out.flush())
+	{
+		std::cerr << "Failed to write " << answersPath << "\n";
+		return -1;
+	}
+
+	return total;
 }
 
-int DoMarkovMonte(int iterations)
+// Answers strategy queries from the --advise shard: text from stdin to stdout, or binary from
+// --queries to --answers
+int DoAdvise(const SimulationOptions& options)
 {
+	const auto startTime = std::chrono::steady_clock::now();
+
+	ShardHeader header;
 	ResultsTable resultsTable;
+	if (!ReadShard(options.advisePath, header, resultsTable))
+		return 1;
+
+	FillUnreachedCounts(resultsTable);
+	const AdviceIndex index(resultsTable, header.rules);
+	const auto readyTime = std::chrono::steady_clock::now();
+
+	const int64_t queries = options.queriesPath.empty()
+		? AnswerTextQueries(index)
+		: AnswerBinaryQueries(index, options.queriesPath, options.answersPath);
+	if (queries < 0)
+		return 1;
+
+	const double startupMilliseconds = std::chrono::duration<double, std::milli>(readyTime - startTime).count();
+	const double elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - readyTime).count();
+	std::cerr << "Loaded the index in " << startupMilliseconds << "ms, then answered " << queries << " queries in " << elapsedSeconds << "s ("
+		<< static_cast<int64_t>(queries / std::max(1e-9, elapsedSeconds)) << " queries/s)\n";
+	return 0;
+}
 
-	srand(static_cast<unsigned int>(time(NULL)));
-	DeckShoe shoeCards(6);
-	MasterDeckShoeView shoe(shoeCards);
-	Player dealer(std::string("Dealer"), 0);
-	
-	Player player("Player 1", 0.0);
+// Parses count:bet pairs like 2:2,3:4,4:8 into count order
+bool ParseBetSpread(const std::string& text, std::vector<std::pair<int, int>>& betSpread)
+{
+	betSpread.clear();
 
-	for (int round = 0; round != iterations; round++)
+	std::istringstream in(text);
+	std::string pair;
+	while (std::getline(in, pair, ','))
 	{
-		player.ClearStats();
-
-		DealerHand dealerHand;
-		PlayerHand playerHand(player);
-
-		shoe.ReloadIfNecessary();
-
-		playerHand.AddCard(shoe.DealCard());
-		dealerHand.AddCard(shoe.DealCard());
-
-		playerHand.AddCard(shoe.DealCard());
-		dealerHand.AddCard(shoe.DealCard());
+		std::istringstream pairIn(pair);
+		int trueCount;
+		char separator;
+		int bet;
+		if (!(pairIn >> trueCount >> separator >> bet) || separator != ':' || bet < 1 || !(pairIn >> std::ws).eof())
+			return false;
+
+		betSpread.emplace_back(trueCount, bet);
+	}
 
-		// Check blackjack push
-		// Check dealer blackjack lose
-		// Check player blackjack win
-		// Do decision tree
+	std::sort(betSpread.begin(), betSpread.end());
+	return !betSpread.empty();
+}
 
-		PlayerSubHand& hand = playerHand.PrimaryHand();
+bool ParseOptions(int argc, char* argv[], SimulationOptions& options)
+{
+	// The iteration count, or with --merge the shards to merge
+	std::vector<std::string> positionalArgs;
+	bool isMerge = false;
 
-		DebugOut(output << "Dealer showing: " << dealerHand.ToString() << " (" << dealerHand.Showing() << ")" << std::endl);
-		DebugOut(output << hand.PlayerName() <<  "'s hand: " << hand.ToString() << " (" << hand.Value() << ")" << std::endl);
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
 
-		if (hand.IsBlackjack() && dealerHand.IsBlackjack())
+		if (arg == "--threads" && i + 1 < argc)
+			options.threads = atoi(argv[++i]);
+		else if (arg == "--sync-interval" && i + 1 < argc)
+			options.syncInterval = atoi(argv[++i]);
+		else if (arg == "--shoe" && i + 1 < argc)
 		{
-			// push
-			DebugOut(output << "Dealer & Player Blackjack, push\n");
-			continue;
+			const std::string shoeType = argv[++i];
+			if (shoeType == "shuffled")
+				options.shoeType = ShoeType::Shuffled;
+			else if (shoeType == "composition")
+				options.shoeType = ShoeType::Composition;
+			else if (shoeType == "infinite")
+				options.shoeType = ShoeType::Infinite;
+			else
+			{
+				std::cerr << "Unknown shoe type: " << shoeType << "\n";
+				return false;
+			}
 		}
-		else if (dealerHand.IsBlackjack())
+		else if (arg == "--dealer" && i + 1 < argc)
 		{
-			DebugOut(output << "Dealer & Player Blackjack, push\n");
-			// TODO: accumulate money
-			continue;
+			const std::string dealerMode = argv[++i];
+			if (dealerMode == "sample")
+				options.exactDealer = false;
+			else if (dealerMode == "exact")
+				options.exactDealer = true;
+			else
+			{
+				std::cerr << "Unknown dealer mode: " << dealerMode << "\n";
+				return false;
+			}
 		}
-		else if (hand.IsBlackjack())
+		else if (arg == "--exact")
+			options.exactEv = true;
+		else if (arg == "--batch" && i + 1 < argc)
+			options.batchLanes = atoi(argv[++i]);
+		else if (arg == "--count")
+			options.trueCount = true;
+		else if (arg == "--stratify")
+			options.dealMode = DealMode::Stratified;
+		else if (arg == "--adaptive")
+			options.dealMode = DealMode::Adaptive;
+		else if (arg == "--shard" && i + 1 < argc)
+			options.shardPath = argv[++i];
+		else if (arg == "--merge")
+			isMerge = true;
+		else if (arg == "--decks" && i + 1 < argc)
+			options.rules.decks = atoi(argv[++i]);
+		else if (arg == "--penetration" && i + 1 < argc)
+			options.rules.penetration = atof(argv[++i]);
+		else if (arg == "--max-hands" && i + 1 < argc)
+			options.rules.maxHands = atoi(argv[++i]);
+		else if (arg == "--seats" && i + 1 < argc)
+			options.rules.seats = atoi(argv[++i]);
+		else if (arg == "--h17" || arg == "--s17")
+			options.rules.hitSoft17 = arg == "--h17";
+		else if (arg == "--das" || arg == "--no-das")
+			options.rules.doubleAfterSplit = arg == "--das";
+		else if (arg == "--hit-split-aces")
+			options.rules.hitSplitAces = true;
+		else if (arg == "--blackjack-pays" && i + 1 < argc)
 		{
-			DebugOut(output << "Blackjack!\n");
-			// TODO: accumulate money
-			continue;
+			const std::string payout = argv[++i];
+			if (payout == "3:2")
+				options.rules.blackjackPayout = BlackjackPayout::ThreeToTwo;
+			else if (payout == "6:5")
+				options.rules.blackjackPayout = BlackjackPayout::SixToFive;
+			else
+			{
+				std::cerr << "Unknown blackjack payout: " << payout << "\n";
+				return false;
+			}
 		}
-
-		int dealerHandIndex = MapDealerHandToActionIndex(dealerHand.Showing());
-		int playerHandIndex = MapPlayerHandToActionIndex(hand);
-		
-		int maxShoeOffset = 0;
-		constexpr std::array<Action, 4> allActions { Action::Stand, Action::Hit, Action::DoubleDown, Action::Split};
-		for (Action action : allActions)
+		else if (arg == "--seed" && i + 1 < argc)
 		{
-			if (!CanDoAction(hand, action))
-				continue;
+			options.seed = std::stoull(argv[++i]);
+			options.hasSeed = true;
+		}
+		else if (arg == "--confidence" && i + 1 < argc)
+			options.confidence = atof(argv[++i]);
+		else if (arg == "--ci-tolerance" && i + 1 < argc)
+			options.ciTolerance = atof(argv[++i]);
+		else if (arg == "--checkpoint" && i + 1 < argc)
+			options.checkpointPath = argv[++i];
+		else if (arg == "--checkpoint-rounds" && i + 1 < argc)
+			options.checkpointRounds = atoi(argv[++i]);
+		else if (arg == "--checkpoint-seconds" && i + 1 < argc)
+			options.checkpointSeconds = atof(argv[++i]);
+		else if (arg == "--resume")
+			options.resume = true;
+		else if (arg == "--stats")
+			options.stats = true;
+		else if (arg == "--stats-interval" && i + 1 < argc)
+			options.statsSeconds = atof(argv[++i]);
+		else if (arg == "--sessions" && i + 1 < argc)
+			options.sessions = atoi(argv[++i]);
+		else if (arg == "--policy" && i + 1 < argc)
+			options.policyPath = argv[++i];
+		else if (arg == "--advise" && i + 1 < argc)
+			options.advisePath = argv[++i];
+		else if (arg == "--queries" && i + 1 < argc)
+			options.queriesPath = argv[++i];
+		else if (arg == "--answers" && i + 1 < argc)
+			options.answersPath = argv[++i];
+		else if (arg == "--session-hands" && i + 1 < argc)
+			options.sessionHands = atoi(argv[++i]);
+		else if (arg == "--bankroll" && i + 1 < argc)
+			options.bankroll = atof(argv[++i]);
+		else if (arg == "--bet-spread" && i + 1 < argc)
+		{
+			if (!ParseBetSpread(argv[++i], options.betSpread))
+			{
+				std::cerr << "--bet-spread takes count:bet pairs separated by commas, with bets of at least 1, e.g. 2:2,3:4,4:8\n";
+				return false;
+			}
+		}
+		else if (arg == "--trace" && i + 1 < argc)
+			options.tracePath = argv[++i];
+		else if (arg == "--decode-trace" && i + 1 < argc)
+			options.decodeTracePath = argv[++i];
+		else if (arg == "--corpus" && i + 1 < argc)
+			options.corpusPath = argv[++i];
+		else if (arg == "--write-corpus" && i + 1 < argc)
+			options.writeCorpusPath = argv[++i];
+		else if (arg == "--corpus-shoes" && i + 1 < argc)
+			options.corpusShoes = atoi(argv[++i]);
+		else if (arg == "--snapshot" && i + 1 < argc)
+			options.snapshotPath = argv[++i];
+		else if (arg == "--snapshot-rounds" && i + 1 < argc)
+			options.snapshotRounds = atoi(argv[++i]);
+		else if (arg == "--snapshot-format" && i + 1 < argc)
+		{
+			const std::string snapshotFormat = argv[++i];
+			if (snapshotFormat == "csv")
+				options.snapshotFormat = SnapshotFormat::Csv;
+			else if (snapshotFormat == "json")
+				options.snapshotFormat = SnapshotFormat::Json;
+			else if (snapshotFormat == "binary")
+				options.snapshotFormat = SnapshotFormat::Binary;
+			else
+			{
+				std::cerr << "Unknown snapshot format: " << snapshotFormat << "\n";
+				return false;
+			}
+		}
+		else if (arg.compare(0, 2, "--") != 0)
+			positionalArgs.push_back(arg);
+		else
+		{
+			std::cerr << "Unknown option: " << arg << "\n";
+			return false;
+		}
+	}
+
+	if (isMerge)
+		options.mergePaths = positionalArgs;
+	else if (!positionalArgs.empty())
+		options.iterations = atoi(positionalArgs.back().c_str());
+
+	if (isMerge && options.mergePaths.empty())
+	{
+		std::cerr << "--merge needs at least one shard to merge\n";
+		return false;
+	}
 
-			if (action == Action::Split)
-				assert(playerHandIndex > 20);
+	// Ten valued cards are counted in bytes by the dealer outcome cache, which caps the shoe at 8 decks
+	if (options.rules.decks < 1 || options.rules.decks > 8 || options.rules.penetration <= 0 || options.rules.penetration > 1 || options.rules.maxHands < 1)
+	{
+		std::cerr << "--decks must be 1 to 8, --penetration above 0 and at most 1, and --max-hands at least 1\n";
+		return false;
+	}
 
-			PlayerHand handClone = playerHand;
-			DealerHand dealerHandClone = dealerHand;
-			DeckShoeView shoeClone = shoe;
+	if (options.batchLanes < 0 || (options.batchLanes > 0 && (options.shoeType != ShoeType::Shuffled || options.exactDealer)))
+	{
+		std::cerr << "--batch needs a positive lane count, and only runs with --shoe shuffled and --dealer sample\n";
+		return false;
+	}
 
-			DebugOut(output << "\nTrying action: ");
-			DoAction(handClone, handClone.PrimaryHand(), action, shoeClone);
+	if (options.rules.seats < 1 || options.rules.seats > 7 || (options.rules.seats > 1 && (options.batchLanes > 0 || options.dealMode != DealMode::Natural)))
+	{
+		std::cerr << "--seats must be 1 to 7, and more than one doesn't work with --batch, --stratify or --adaptive\n";
+		return false;
+	}
 
-			double result = CompleteOptimally(dealerHandClone, handClone, resultsTable, shoeClone, action);
+	// Shoes don't check for running out part way through a round, so a full table needs enough
+	// cards left at the reshuffle point for every seat and the dealer to draw, branches included
+	if (options.rules.seats > 1 && (1 - options.rules.penetration) * 52 * options.rules.decks < c_handReserveCards * (options.rules.seats + 1))
+	{
+		std::cerr << "--seats " << options.rules.seats << " needs at least " << c_handReserveCards * (options.rules.seats + 1) << " cards left at the --penetration point\n";
+		return false;
+	}
 
-			DebugOut(output << "Result: " << result << "\n");
+	if (options.dealMode != DealMode::Natural && options.batchLanes > 0)
+	{
+		std::cerr << "--stratify and --adaptive don't work with --batch, which always deals naturally\n";
+		return false;
+	}
 
-			resultsTable.RecordResult(dealerHandIndex, playerHandIndex, action, result);
+	if (!options.corpusPath.empty() && options.shoeType != ShoeType::Shuffled)
+	{
+		std::cerr << "--corpus only deals with --shoe shuffled\n";
+		return false;
+	}
 
-			maxShoeOffset = std::max(maxShoeOffset, shoeClone.Offset());
-		}
+	if (!options.writeCorpusPath.empty() && options.corpusShoes < 1)
+	{
+		std::cerr << "--corpus-shoes must be at least 1\n";
+		return false;
+	}
 
-		shoe.SetOffset(maxShoeOffset);
+	if (options.sessions < 0 || (options.sessions > 0 && (options.policyPath.empty() || options.sessionHands < 1 || options.bankroll < 1)))
+	{
+		std::cerr << "--sessions needs a --policy shard to play, --session-hands of at least 1 and a --bankroll of at least 1\n";
+		return false;
+	}
 
-		player.SignalNewHand();
+	if (options.queriesPath.empty() != options.answersPath.empty() || (!options.queriesPath.empty() && options.advisePath.empty()))
+	{
+		std::cerr << "--queries and --answers go together, with --advise\n";
+		return false;
+	}
 
-		//std::string temp;
-		//std::getline(std::cin, temp);
+	if (!options.tracePath.empty() && c_traceLevel == 0)
+	{
+		std::cerr << "--trace needs a build configured with -DBLACKJACKSIM_TRACE_LEVEL=1 or 2\n";
+		return false;
 	}
 
-	PrintResultsTable(resultsTable);
+	if (options.resume && options.checkpointPath.empty())
+	{
+		std::cerr << "--resume needs a --checkpoint to resume from\n";
+		return false;
+	}
 
-	return 0;
+	return true;
 }
 
 
+// The benchmarks build this file into their own executable, with their own main
+#ifndef BLACKJACKSIM_NO_MAIN
 int main(int argc, char* argv[])
 {
-	int iterations = 1'000'000;
-	if (argc >= 2)
-		iterations = atoi(argv[1]);
+	SimulationOptions options;
+	if (!ParseOptions(argc, argv, options))
+		return 1;
 
 	//PlayInteractively();
-	return DoMarkovMonte(iterations);
+	if (!options.decodeTracePath.empty())
+		return DoDecodeTrace(options);
+
+	if (!options.mergePaths.empty())
+		return DoMerge(options);
+
+	if (!options.writeCorpusPath.empty())
+		return DoWriteCorpus(options);
+
+	if (!options.advisePath.empty())
+		return DoAdvise(options);
+
+	if (options.exactEv)
+		return DoExactEv(options);
+
+	const int exitCode = options.sessions > 0 ? DoSessions(options) : DoMarkovMonte(options);
+
+	// Every thread that traced has finished by now
+	if (!options.tracePath.empty() && !WriteTrace(options.tracePath))
+		return 1;
+
+	return exitCode;
 }
+#endif
@@ -0,0 +1,319 @@
+// BlackJackSimBench.cpp : Microbenchmarks for the simulator's hot paths
+//
+// Builds the simulator itself into this executable, so the benchmarks measure exactly the code
+// the simulation runs, inlining included. Every benchmark is seeded, so runs are repeatable.
+
+#define BLACKJACKSIM_NO_MAIN
+#include "BlackJackSim.cpp"
+
+#include <functional>
+#include <iomanip>
+
+// Results are folded into this so the optimizer can't throw the work away
+volatile uint64_t g_benchmarkSink;
+
+struct BenchmarkOptions
+{
+	std::string filter;         // Only run benchmarks whose name contains this
+	double minSeconds = 0.5;    // Each repetition runs for at least this long
+	int repetitions = 5;        // The median repetition is reported
+};
+
+// Runs body(iterations) in growing batches until a batch takes minSeconds, then times that many
+// iterations for each repetition and reports the median
+void RunBenchmark(const BenchmarkOptions& options, const char* name, const std::function<void(int)>& body)
+{
+	if (std::string(name).find(options.filter) == std::string::npos)
+		return;
+
+	using Clock = std::chrono::steady_clock;
+	auto timeBatch = [&](int iterations) {
+		const auto start = Clock::now();
+		body(iterations);
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	};
+
+	int iterations = 1;
+	while (timeBatch(iterations) < options.minSeconds && iterations < (1 << 30))
+		iterations *= 2;
+
+	std::vector<double> nanosecondsPerOp;
+	for (int i = 0; i < std::max(1, options.repetitions); i++)
+		nanosecondsPerOp.push_back(timeBatch(iterations) * 1e9 / iterations);
+
+	std::sort(nanosecondsPerOp.begin(), nanosecondsPerOp.end());
+	const double median = nanosecondsPerOp[nanosecondsPerOp.size() / 2];
+
+	std::cout << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(14) << median << std::setw(16) << std::setprecision(0) << 1e9 / median << "\n";
+}
+
+// A policy table with some play behind it, so lookups and completions take realistic paths
+ResultsTable MakeTrainedTable()
+{
+	SimulationOptions options;
+	options.iterations = 200'000;
+	options.seed = 1;
+	options.hasSeed = true;
+
+	ResultsTable table;
+	RunMarkovMonte<DefaultRuleSet, ShuffledShoe>(options, table);
+	return table;
+}
+
+void BenchmarkHands(const BenchmarkOptions& options)
+{
+	// Deals runs of two to five cards, the usual length of a hand
+	DeckShoe deckShoe(6, RandomEngine(1));
+	RunBenchmark(options, "Hand::AddCard+Value (per hand)", [&](int iterations) {
+		size_t offset = 0;
+		uint64_t sum = 0;
+		for (int i = 0; i < iterations; i++)
+		{
+			if (offset + 5 > deckShoe.Size())
+				offset = 0;
+
+			Hand hand;
+			const int cardCount = 2 + i % 4;
+			for (int card = 0; card < cardCount; card++)
+				hand.AddCard(deckShoe.GetCard(offset++));
+			sum += hand.Value();
+		}
+		g_benchmarkSink += sum;
+	});
+}
+
+void BenchmarkShoes(const BenchmarkOptions& options)
+{
+	DeckShoe deckShoe(6, RandomEngine(1));
+	RunBenchmark(options, "DeckShoe::Reload (6 decks)", [&](int iterations) {
+		for (int i = 0; i < iterations; i++)
+			deckShoe.Reload();
+		g_benchmarkSink += deckShoe.GetCard(0).Face() == CardFace::Ace;
+	});
+
+	// The same reload dealing from a corpus instead of shuffling. The corpus is written to a
+	// scratch file, as it's only ever read through a mapping.
+	SimulationOptions corpusOptions;
+	corpusOptions.writeCorpusPath = "BlackJackSimBench.corpus";
+	corpusOptions.corpusShoes = 4096;
+	corpusOptions.seed = 1;
+	corpusOptions.hasSeed = true;
+
+	if (DoWriteCorpus(corpusOptions) == 0)
+	{
+		ShoeCorpus corpus;
+		if (corpus.Open(corpusOptions.writeCorpusPath))
+		{
+			DeckShoe corpusShoe(6, RandomEngine(1), CorpusStream{ &corpus, 0, 1 });
+			RunBenchmark(options, "DeckShoe::Reload (6 deck corpus)", [&](int iterations) {
+				for (int i = 0; i < iterations; i++)
+					corpusShoe.Reload();
+				g_benchmarkSink += corpusShoe.GetCard(0).Face() == CardFace::Ace;
+			});
+		}
+	}
+	std::remove(corpusOptions.writeCorpusPath.c_str());
+
+	CompositionShoe compositionShoe(6, 0.7, RandomEngine(1));
+	RunBenchmark(options, "CompositionShoe::DealCard", [&](int iterations) {
+		uint64_t sum = 0;
+		for (int i = 0; i < iterations; i++)
+		{
+			compositionShoe.ReloadIfNecessary();
+			sum += compositionShoe.DealCard().Value();
+		}
+		g_benchmarkSink += sum;
+	});
+}
+
+void BenchmarkPolicy(const BenchmarkOptions& options, const ResultsTable& table)
+{
+	RunBenchmark(options, "GetOptimalAction", [&](int iterations) {
+		uint64_t sum = 0;
+		for (int i = 0; i < iterations; i++)
+		{
+			const int playerHandIndex = i % c_maxPlayerHandIndex;
+			const uint8_t actionMask = playerHandIndex > 20 ? 0xF : 0x7;
+			sum += static_cast<uint64_t>(GetOptimalAction(table, i % c_maxDealerHandIndex, playerHandIndex, actionMask));
+		}
+		g_benchmarkSink += sum;
+	});
+
+	const PolicyTable policy(table);
+	RunBenchmark(options, "PolicyTable::GetOptimalAction", [&](int iterations) {
+		uint64_t sum = 0;
+		for (int i = 0; i < iterations; i++)
+		{
+			const int playerHandIndex = i % c_maxPlayerHandIndex;
+			const uint8_t actionMask = playerHandIndex > 20 ? 0xF : 0x7;
+			sum += static_cast<uint64_t>(policy.GetOptimalAction(i % c_maxDealerHandIndex, playerHandIndex, actionMask));
+		}
+		g_benchmarkSink += sum;
+	});
+
+	// What recording a result costs on top of the table itself
+	PolicyTable refreshedPolicy(table);
+	RunBenchmark(options, "PolicyTable::Refresh", [&](int iterations) {
+		for (int i = 0; i < iterations; i++)
+			refreshedPolicy.Refresh(table, i % c_maxDealerHandIndex, i % c_maxPlayerHandIndex);
+		g_benchmarkSink += static_cast<uint64_t>(refreshedPolicy.GetOptimalAction(0, 0, 0x3));
+	});
+
+	// Dealt hands of two or three cards, like --advise queries
+	const AdviceIndex adviceIndex(table, TableRules());
+	std::vector<AdviceQuery> queries(4096);
+	std::mt19937 queryRandom(1);
+	for (AdviceQuery& query : queries)
+	{
+		query = {};
+		query.upcard = static_cast<uint8_t>(1 + queryRandom() % 10);
+		query.cardCount = static_cast<uint8_t>(2 + queryRandom() % 4 / 3);
+		for (int i = 0; i < query.cardCount; i++)
+			query.cards[i] = static_cast<uint8_t>(1 + queryRandom() % 10);
+	}
+	RunBenchmark(options, "AdviceIndex::Answer", [&](int iterations) {
+		uint64_t sum = 0;
+		for (int i = 0; i < iterations; i++)
+			sum += adviceIndex.Answer(queries[i % queries.size()]).action;
+		g_benchmarkSink += sum;
+	});
+
+	DeckShoe deckShoe(6, RandomEngine(1));
+	Player player("Player 1", 0.0);
+	RunBenchmark(options, "CompleteOptimally (after a hit)", [&](int iterations) {
+		DeckShoeView shoe(deckShoe);
+		double sum = 0;
+		for (int i = 0; i < iterations; i++)
+		{
+			if (shoe.Offset() > 250)
+				shoe.SetOffset(0);
+
+			DealerHand dealerHand;
+			PlayerHand playerHand(player);
+			playerHand.AddCard(shoe.DealCard());
+			dealerHand.AddCard(shoe.DealCard());
+			playerHand.AddCard(shoe.DealCard());
+			dealerHand.AddCard(shoe.DealCard());
+
+			if (playerHand.PrimaryHand().Value() >= 21 || dealerHand.IsBlackjack())
+				continue;
+
+			DoAction(playerHand, playerHand.PrimaryHand(), Action::Hit, shoe);
+			sum += CompleteOptimally<DefaultRuleSet>(dealerHand, playerHand, policy, 0, shoe, Action::Hit);
+		}
+		g_benchmarkSink += static_cast<uint64_t>(sum);
+	});
+}
+
+// The state the round loop rolls back to before trying each action
+void BenchmarkBranchReset(const BenchmarkOptions& options)
+{
+	DeckShoe deckShoe(6, RandomEngine(1));
+	DeckShoeView dealtShoe(deckShoe);
+	Player player("Player 1", 0.0);
+
+	DealerHand dealerHand;
+	PlayerHand playerHand(player);
+	playerHand.AddCard(dealtShoe.DealCard());
+	dealerHand.AddCard(dealtShoe.DealCard());
+	playerHand.AddCard(dealtShoe.DealCard());
+	dealerHand.AddCard(dealtShoe.DealCard());
+
+	PlayerHand branchHand(player);
+	DealerHand branchDealerHand;
+	DeckShoeView branchShoe = dealtShoe;
+	RunBenchmark(options, "Branch reset (per action)", [&](int iterations) {
+		uint64_t sum = 0;
+		for (int i = 0; i < iterations; i++)
+		{
+			branchHand = playerHand;
+			branchDealerHand = dealerHand;
+			branchShoe = dealtShoe;
+			branchHand.PrimaryHand().AddCard(branchShoe.DealCard());
+			sum += branchHand.PrimaryHand().Value();
+		}
+		g_benchmarkSink += sum;
+	});
+}
+
+template <typename TShoe>
+void BenchmarkRounds(const BenchmarkOptions& options, const ResultsTable& table, const char* name, bool exactDealer, const TableRules& rules = TableRules())
+{
+	MarkovMonteWorker<DefaultRuleSet, TShoe> worker(table, rules, RandomEngine(1), exactDealer);
+	RunBenchmark(options, name, [&](int iterations) {
+		worker.RunRounds(iterations);
+	});
+}
+
+// Timed per round, so it compares directly with BenchmarkRounds
+void BenchmarkBatchRounds(const BenchmarkOptions& options, const ResultsTable& table, int laneCount)
+{
+	const std::string name = "Round (batch of " + std::to_string(laneCount) + ")";
+	BatchMarkovMonteWorker<DefaultRuleSet> worker(table, TableRules(), RandomEngine(1), laneCount);
+	RunBenchmark(options, name.c_str(), [&](int iterations) {
+		worker.RunRounds(iterations);
+	});
+}
+
+// An op is a whole session, with a bankroll that never runs out so every session is the same length
+void BenchmarkSessions(const BenchmarkOptions& options, const ResultsTable& table)
+{
+	const PolicyTable policy(table);
+	SimulationOptions sessionOptions;
+	sessionOptions.sessionHands = 100;
+	sessionOptions.bankroll = 1e9;
+
+	SessionWorker<DefaultRuleSet> worker(policy, TableRules(), RandomEngine(1), sessionOptions);
+	RunBenchmark(options, "Session (100 hands)", [&](int iterations) {
+		worker.RunSessions(iterations);
+	});
+}
+
+int main(int argc, char* argv[])
+{
+	BenchmarkOptions options;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+
+		if (arg == "--filter" && i + 1 < argc)
+			options.filter = argv[++i];
+		else if (arg == "--min-time" && i + 1 < argc)
+			options.minSeconds = atof(argv[++i]);
+		else if (arg == "--repetitions" && i + 1 < argc)
+			options.repetitions = atoi(argv[++i]);
+		else
+		{
+			std::cerr << "Usage: BlackJackSimBench [--filter NAME] [--min-time SECONDS] [--repetitions N]\n";
+			return 1;
+		}
+	}
+
+	const ResultsTable table = MakeTrainedTable();
+
+	std::cout << std::left << std::setw(36) << "Benchmark" << std::right << std::setw(14) << "ns/op" << std::setw(16) << "ops/sec" << "\n";
+
+	BenchmarkHands(options);
+	BenchmarkShoes(options);
+	BenchmarkPolicy(options, table);
+	BenchmarkBranchReset(options);
+
+	// For these an op is a whole round, so ops/sec is rounds/sec
+	BenchmarkRounds<ShuffledShoe>(options, table, "Round (shuffled shoe)", false);
+	BenchmarkRounds<CompositionShoe>(options, table, "Round (composition shoe)", false);
+	BenchmarkRounds<InfiniteShoe>(options, table, "Round (infinite shoe)", false);
+	BenchmarkRounds<ShuffledShoe>(options, table, "Round (shuffled shoe, exact dealer)", true);
+	BenchmarkBatchRounds(options, table, 32);
+
+	// A round here is every seat's, so divide by seven to compare with a single seat
+	TableRules fullTable;
+	fullTable.seats = 7;
+	BenchmarkRounds<ShuffledShoe>(options, table, "Round (7 seats, shuffled shoe)", false, fullTable);
+	BenchmarkRounds<ShuffledShoe>(options, table, "Round (7 seats, exact dealer)", true, fullTable);
+
+	BenchmarkSessions(options, table);
+
+	return 0;
+}